@@ -0,0 +1,261 @@
+#include "archive.h"
+#include "common.h"
+
+#include <QDataStream>
+#include <QDebug>
+#include <QFileInfo>
+#include <QHash>
+#include <QtEndian>
+
+#include <algorithm>
+#include <cstring>
+
+// The data after each texture and palette header starts on a multiple of
+// this, so it can be DMA:d or store-queued straight from a loaded archive.
+#define ARCHIVE_ALIGNMENT		32
+
+#define ARCHIVE_HEADER_SIZE		8
+#define ARCHIVE_ENTRY_SIZE		16
+#define TEXTURE_HEADER_SIZE		16
+#define PALETTE_HEADER_SIZE		8
+
+quint32 archiveHash(const QByteArray& name) {
+	quint32 hash = 2166136261u;
+	for (int i=0; i<name.size(); i++) {
+		hash ^= (uchar)name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// Returns the offset to put something with a 'headerSize' byte header at,
+// at or after 'offset', so that the data after the header is aligned.
+static int alignPayload(int offset, int headerSize) {
+	const int dataOffset = (offset + headerSize + ARCHIVE_ALIGNMENT - 1) & ~(ARCHIVE_ALIGNMENT - 1);
+	return dataOffset - headerSize;
+}
+
+struct IndexEntry {
+	quint32		hash;
+	QByteArray	name;	// UTF-8
+	int			index;	// In the entries given to writeArchive()
+	int			nameOffset;
+	int			textureOffset;
+	int			paletteOffset;
+};
+
+static bool lessThan(const IndexEntry& a, const IndexEntry& b) {
+	return (a.hash != b.hash) ? (a.hash < b.hash) : (a.name < b.name);
+}
+
+bool writeArchive(const QString& filename, const QVector<ArchiveEntry>& entries) {
+	// The index is sorted by hash, so the target can binary search it
+	QVector<IndexEntry> index(entries.size());
+	for (int i=0; i<entries.size(); i++) {
+		index[i].name = entries[i].name.toUtf8();
+		index[i].hash = archiveHash(index[i].name);
+		index[i].index = i;
+	}
+	std::sort(index.begin(), index.end(), lessThan);
+
+	int offset = ARCHIVE_HEADER_SIZE + ARCHIVE_ENTRY_SIZE * index.size();
+	for (int i=0; i<index.size(); i++) {
+		if (i > 0 && index[i].name == index[i-1].name) {
+			qCritical() << "There are two textures called" << entries[index[i].index].name;
+			return false;
+		}
+		index[i].nameOffset = offset;
+		offset += index[i].name.size() + 1;
+	}
+
+	// Lay out the payloads in index order. Identical ones get the same offset.
+	QHash<QByteArray, int> textureOffsets;
+	QHash<QByteArray, int> paletteOffsets;
+	QVector<int> payloadOffsets;
+	QVector<const QByteArray*> payloads;
+	for (int i=0; i<index.size(); i++) {
+		const ArchiveEntry& entry = entries[index[i].index];
+
+		index[i].textureOffset = textureOffsets.value(entry.texture, 0);
+		if (index[i].textureOffset == 0) {
+			offset = alignPayload(offset, TEXTURE_HEADER_SIZE);
+			index[i].textureOffset = offset;
+			textureOffsets.insert(entry.texture, offset);
+			payloadOffsets.push_back(offset);
+			payloads.push_back(&entry.texture);
+			offset += entry.texture.size();
+		}
+
+		index[i].paletteOffset = 0;
+		if (!entry.palette.isEmpty()) {
+			index[i].paletteOffset = paletteOffsets.value(entry.palette, 0);
+			if (index[i].paletteOffset == 0) {
+				offset = alignPayload(offset, PALETTE_HEADER_SIZE);
+				index[i].paletteOffset = offset;
+				paletteOffsets.insert(entry.palette, offset);
+				payloadOffsets.push_back(offset);
+				payloads.push_back(&entry.palette);
+				offset += entry.palette.size();
+			}
+		}
+	}
+
+	QFile file(filename);
+	if (!file.open(QIODevice::WriteOnly)) {
+		qCritical() << "Failed to open" << filename;
+		return false;
+	}
+	QDataStream out(&file);
+	out.setByteOrder(QDataStream::LittleEndian);
+
+	// Write header
+	out.writeRawData(ARCHIVE_MAGIC, 4);
+	out << (qint32)index.size();
+
+	// Write the index and the names
+	foreach (const IndexEntry& entry, index) {
+		out << (quint32)entry.hash;
+		out << (qint32)entry.nameOffset;
+		out << (qint32)entry.textureOffset;
+		out << (qint32)entry.paletteOffset;
+	}
+	foreach (const IndexEntry& entry, index)
+		out.writeRawData(entry.name.constData(), entry.name.size() + 1);
+
+	// Write the payloads, padded to their offsets
+	int position = index.isEmpty() ? ARCHIVE_HEADER_SIZE : (index.last().nameOffset + index.last().name.size() + 1);
+	for (int i=0; i<payloads.size(); i++) {
+		writeZeroes(out, payloadOffsets[i] - position);
+		out.writeRawData(payloads[i]->constData(), payloads[i]->size());
+		position = payloadOffsets[i] + payloads[i]->size();
+	}
+
+	file.close();
+	if (out.status() != QDataStream::Ok) {
+		qCritical() << "Failed to write" << filename;
+		return false;
+	}
+
+	qDebug() << "Packed" << entries.size() << "textures into" << filename << "with" << textureOffsets.size() << "unique textures," << position << "bytes";
+	return true;
+}
+
+bool TextureArchive::open(const QString& filename) {
+	close();
+
+	file.setFileName(filename);
+	if (!file.open(QIODevice::ReadOnly)) {
+		qCritical() << "Failed to open" << filename;
+		return false;
+	}
+	const qint64 size = file.size();
+	const uchar* data = (size >= ARCHIVE_HEADER_SIZE) ? file.map(0, size) : NULL;
+	if (!data || memcmp(data, ARCHIVE_MAGIC, 4) != 0) {
+		qCritical() << filename << "is not a valid archive";
+		close();
+		return false;
+	}
+
+	// Check that everything in the index is inside the file before handing
+	// any of it out
+	const qint32 count = qFromLittleEndian<qint32>(data + 4);
+	bool ok = (count >= 0 && ARCHIVE_HEADER_SIZE + ARCHIVE_ENTRY_SIZE * (qint64)count <= size);
+	for (int i=0; ok && i<count; i++) {
+		const uchar* indexEntry = data + ARCHIVE_HEADER_SIZE + ARCHIVE_ENTRY_SIZE * i;
+		const quint32 hash = qFromLittleEndian<quint32>(indexEntry);
+		const qint32 nameOffset = qFromLittleEndian<qint32>(indexEntry + 4);
+		const qint32 textureOffset = qFromLittleEndian<qint32>(indexEntry + 8);
+		const qint32 paletteOffset = qFromLittleEndian<qint32>(indexEntry + 12);
+
+		const uchar* nameEnd = (nameOffset >= 0 && nameOffset < size) ? (const uchar*)memchr(data + nameOffset, 0, size - nameOffset) : NULL;
+		if (!nameEnd || textureOffset < 0 || textureOffset + (qint64)TEXTURE_HEADER_SIZE > size || paletteOffset < 0 || paletteOffset + (qint64)PALETTE_HEADER_SIZE > size) {
+			ok = false;
+			break;
+		}
+		const QByteArray name((const char*)data + nameOffset, nameEnd - (data + nameOffset));
+		const qint32 textureSize = qFromLittleEndian<qint32>(data + textureOffset + 12);
+		const qint32 colorCount = paletteOffset ? qFromLittleEndian<qint32>(data + paletteOffset + 4) : 0;
+		if (archiveHash(name) != hash || (i > 0 && hash < hashes.last())
+			|| textureSize < 0 || textureOffset + (qint64)TEXTURE_HEADER_SIZE + textureSize > size
+			|| colorCount < 0 || paletteOffset + (qint64)PALETTE_HEADER_SIZE + 4 * (qint64)colorCount > size) {
+			ok = false;
+			break;
+		}
+
+		ArchiveEntry entry;
+		entry.name = QString::fromUtf8(name);
+		entry.texture = QByteArray::fromRawData((const char*)data + textureOffset, TEXTURE_HEADER_SIZE + textureSize);
+		if (paletteOffset)
+			entry.palette = QByteArray::fromRawData((const char*)data + paletteOffset, PALETTE_HEADER_SIZE + 4 * colorCount);
+		entries.push_back(entry);
+		hashes.push_back(hash);
+	}
+
+	if (!ok) {
+		qCritical() << filename << "is not a valid archive";
+		close();
+		return false;
+	}
+	return true;
+}
+
+void TextureArchive::close() {
+	entries.clear();
+	hashes.clear();
+	file.close();
+}
+
+int TextureArchive::find(const QString& name) const {
+	const QByteArray utf8 = name.toUtf8();
+	const quint32 hash = archiveHash(utf8);
+	for (int i = std::lower_bound(hashes.begin(), hashes.end(), hash) - hashes.begin(); i<hashes.size() && hashes[i] == hash; i++) {
+		if (entries[i].name == name)
+			return i;
+	}
+	return -1;
+}
+
+bool loadTexture(const QString& filename, QByteArray& texture, QByteArray& palette) {
+	texture.clear();
+	palette.clear();
+
+	// "archive:name". The first ':' that comes after an existing file
+	// ends the archive filename, so drive letters are fine.
+	for (int i = filename.indexOf(':'); i >= 0; i = filename.indexOf(':', i + 1)) {
+		const QString archiveFilename = filename.left(i);
+		if (!QFileInfo(archiveFilename).isFile())
+			continue;
+
+		TextureArchive archive;
+		if (!archive.open(archiveFilename))
+			return false;
+		const int index = archive.find(filename.mid(i + 1));
+		if (index < 0) {
+			qCritical() << "There's no" << filename.mid(i + 1) << "in" << archiveFilename;
+			return false;
+		}
+		// Copy them, they're gone when the archive is closed
+		texture = QByteArray(archive.entry(index).texture.constData(), archive.entry(index).texture.size());
+		palette = QByteArray(archive.entry(index).palette.constData(), archive.entry(index).palette.size());
+		return true;
+	}
+
+	QFile textureFile(filename);
+	if (!textureFile.open(QIODevice::ReadOnly)) {
+		qCritical() << "Failed to open" << filename;
+		return false;
+	}
+	texture = textureFile.readAll();
+	if (texture.startsWith(LZTEXTURE_MAGIC)) {
+		const QByteArray container = texture;
+		if (!lzUnpackTexture(container, texture)) {
+			qCritical() << filename << "is not a valid LZ texture";
+			return false;
+		}
+	}
+
+	QFile paletteFile(filename + ".pal");
+	if (paletteFile.open(QIODevice::ReadOnly))
+		palette = paletteFile.readAll();
+	return true;
+}
@@ -0,0 +1,54 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <QByteArray>
+#include <QFile>
+#include <QString>
+#include <QVector>
+
+// A texture in an archive, or one to put in an archive
+struct ArchiveEntry {
+	QString		name;
+	QByteArray	texture;	// Header and data, like a texture file
+	QByteArray	palette;	// Like a palette file, or empty if there's none
+};
+
+// The hash of a name in the archive index, 32-bit FNV-1a of the UTF-8 name
+quint32 archiveHash(const QByteArray& name);
+
+// Writes 'entries' to an archive. Textures and palettes that are
+// byte-identical to an earlier one are only stored once. Fails if two
+// entries have the same name.
+bool writeArchive(const QString& filename, const QVector<ArchiveEntry>& entries);
+
+// Reads a texture file and its palette file, or a texture in an archive,
+// given as "archive:name". LZ textures are decompressed. The palette is left
+// empty if there's none.
+bool loadTexture(const QString& filename, QByteArray& texture, QByteArray& palette);
+
+// Reads archives. The whole file is mapped, and the entries point straight
+// into it, so they're only valid for as long as the archive is open.
+class TextureArchive {
+public:
+
+	TextureArchive() {}
+	~TextureArchive() { close(); }
+
+	// Fails if the file isn't an archive, or if anything in the index
+	// points outside of it.
+	bool open(const QString& filename);
+	void close();
+
+	int entryCount() const { return entries.size(); }
+	const ArchiveEntry& entry(int index) const { return entries[index]; }
+
+	// Index of the entry called 'name', or -1 if there's none
+	int find(const QString& name) const;
+
+private:
+	QFile			file;
+	QVector<ArchiveEntry>	entries;	// In index order, sorted by hash
+	QVector<quint32>		hashes;
+};
+
+#endif // ARCHIVE_H
@@ -0,0 +1,221 @@
+#include "common.h"
+
+#include <QFile>
+#include <QDataStream>
+#include <QDebug>
+#include <QImage>
+
+#include <algorithm>
+
+// Cells are aligned to this many pixels in mipmapped and compressed atlases,
+// so the 2x2 and 4x4 pixel blocks of compressed textures and the first two
+// mipmap levels never mix two images.
+#define ATLAS_BLOCK_ALIGN	4
+
+// An image in the atlas. The cell is the image with its gutter around it.
+struct AtlasCell {
+	int		index;		// Index of the image in the input
+	int		x;
+	int		y;
+	int		width;
+	int		height;
+};
+
+// A horizontal piece of the skyline, the top edge of the cells placed so far
+struct SkylineSegment {
+	int		x;
+	int		y;
+	int		width;
+};
+
+static int alignUp(int x, int alignment) {
+	return ((x + alignment - 1) / alignment) * alignment;
+}
+
+// Skyline bottom-left packing. Each cell goes where its top ends up the
+// lowest, leftmost first, on the skyline formed by the cells before it.
+// Returns the height used, or -1 if a cell is wider than 'width'.
+static int packSkyline(QVector<AtlasCell>& cells, int width) {
+	QVector<SkylineSegment> skyline;
+	SkylineSegment ground;
+	ground.x = 0;
+	ground.y = 0;
+	ground.width = width;
+	skyline.push_back(ground);
+	int height = 0;
+
+	for (int i=0; i<cells.size(); i++) {
+		AtlasCell& cell = cells[i];
+		if (cell.width > width)
+			return -1;
+
+		// Find the lowest spot, the cell rests on the highest segment under it
+		int best = -1;
+		int bestY = 0;
+		for (int j=0; j<skyline.size() && (skyline[j].x + cell.width) <= width; j++) {
+			int y = 0;
+			for (int k=j; k<skyline.size() && skyline[k].x < (skyline[j].x + cell.width); k++)
+				y = qMax(y, skyline[k].y);
+			if (best == -1 || y < bestY) {
+				best = j;
+				bestY = y;
+			}
+		}
+
+		cell.x = skyline[best].x;
+		cell.y = bestY;
+		height = qMax(height, cell.y + cell.height);
+
+		// Put the top of the cell on the skyline, replacing what's under it
+		SkylineSegment top;
+		top.x = cell.x;
+		top.y = cell.y + cell.height;
+		top.width = cell.width;
+		const int end = cell.x + cell.width;
+		QVector<SkylineSegment> next;
+		foreach (const SkylineSegment& segment, skyline) {
+			const int segmentEnd = segment.x + segment.width;
+			if (segmentEnd <= cell.x) {
+				next.push_back(segment);
+			} else if (segment.x >= end) {
+				next.push_back(segment);
+			} else {
+				if (segment.x == cell.x)
+					next.push_back(top);
+				if (segmentEnd > end) {
+					SkylineSegment rest = segment;
+					rest.x = end;
+					rest.width = segmentEnd - end;
+					next.push_back(rest);
+				}
+			}
+		}
+
+		// Join neighbors of the same height
+		skyline.clear();
+		foreach (const SkylineSegment& segment, next) {
+			if (!skyline.isEmpty() && skyline.last().y == segment.y)
+				skyline.last().width += segment.width;
+			else
+				skyline.push_back(segment);
+		}
+	}
+
+	return height;
+}
+
+bool packAtlas(const QStringList& filenames, int textureType, int padding, QImage& atlas, QVector<QRect>& rects) {
+	const bool mipmapped = (textureType & FLAG_MIPMAPPED);
+	const bool strided = (textureType & FLAG_STRIDED);
+	const int alignment = (mipmapped || (textureType & FLAG_COMPRESSED)) ? ATLAS_BLOCK_ALIGN : 1;
+
+	QVector<QImage> images;
+	QVector<AtlasCell> cells;
+	qint64 imageArea = 0;
+	foreach (const QString& filename, filenames) {
+		const QImage img(filename);
+		if (img.isNull()) {
+			qCritical() << "Failed to load image" << filename;
+			return false;
+		}
+		qDebug() << "Loaded image" << filename;
+
+		AtlasCell cell;
+		cell.index = images.size();
+		cell.x = 0;
+		cell.y = 0;
+		cell.width = alignUp(img.width() + padding * 2, alignment);
+		cell.height = alignUp(img.height() + padding * 2, alignment);
+		cells.push_back(cell);
+		images.push_back(img);
+		imageArea += img.width() * img.height();
+	}
+
+	std::stable_sort(cells.begin(), cells.end(), [](const AtlasCell& a, const AtlasCell& b) {
+		return (a.height != b.height) ? (a.height > b.height) : (a.width > b.width);
+	});
+
+	// Try every valid width and keep the one with the smallest texture. The
+	// height is the next power of two up from what the packing needs.
+	const int minWidth = strided ? TEXTURE_STRIDE_MIN : TEXTURE_SIZE_MIN;
+	const int maxWidth = strided ? TEXTURE_STRIDE_MAX : TEXTURE_SIZE_MAX;
+	int bestWidth = 0;
+	int bestHeight = 0;
+	for (int width=minWidth; width<=maxWidth; width=(strided ? (width + 32) : (width * 2))) {
+		const int used = packSkyline(cells, width);
+		if (used == -1)
+			continue;
+
+		int height = qMax(TEXTURE_SIZE_MIN, nextPowerOfTwo(used));
+		if (mipmapped) {
+			// Mipmapped textures must be square
+			if (height > width)
+				continue;
+			height = width;
+		}
+		if (height > TEXTURE_SIZE_MAX)
+			continue;
+
+		const qint64 area = (qint64)width * height;
+		const qint64 bestArea = (qint64)bestWidth * bestHeight;
+		if (bestWidth == 0 || area < bestArea || (area == bestArea && qAbs(width - height) < qAbs(bestWidth - bestHeight))) {
+			bestWidth = width;
+			bestHeight = height;
+		}
+	}
+
+	if (bestWidth == 0) {
+		qCritical("The images don't fit in a %dx%d atlas", maxWidth, TEXTURE_SIZE_MAX);
+		return false;
+	}
+	packSkyline(cells, bestWidth);
+
+	// Copy the images into their cells. The gutter around each one repeats
+	// its edge pixels, so filtering and mipmaps don't pull in the neighbors.
+	atlas = QImage(bestWidth, bestHeight, QImage::Format_ARGB32);
+	atlas.fill(0);
+	rects.resize(images.size());
+	foreach (const AtlasCell& cell, cells) {
+		const QImage& img = images[cell.index];
+		for (int y=0; y<cell.height; y++) {
+			const int sy = qBound(0, y - padding, img.height() - 1);
+			for (int x=0; x<cell.width; x++) {
+				const int sx = qBound(0, x - padding, img.width() - 1);
+				atlas.setPixel(cell.x + x, cell.y + y, img.pixel(sx, sy));
+			}
+		}
+		rects[cell.index] = QRect(cell.x + padding, cell.y + padding, img.width(), img.height());
+	}
+
+	qDebug("Packed %d images into a %dx%d atlas, %.1f%% used", images.size(), bestWidth, bestHeight, 100.0 * imageArea / ((qint64)bestWidth * bestHeight));
+	return true;
+}
+
+bool saveUVTable(const QString& filename, const QSize& size, const QVector<QRect>& rects) {
+	QFile file(filename);
+
+	if (file.open(QIODevice::WriteOnly)) {
+		QDataStream out(&file);
+		out.setByteOrder(QDataStream::LittleEndian);
+
+		// Write header
+		out.writeRawData(UVTABLE_MAGIC, 4);
+		out << (qint16)size.width();
+		out << (qint16)size.height();
+		out << (qint32)rects.size();
+
+		// Write the rectangles
+		foreach (const QRect& rect, rects) {
+			out << (quint16)rect.x();
+			out << (quint16)rect.y();
+			out << (quint16)rect.width();
+			out << (quint16)rect.height();
+		}
+
+		file.close();
+		return true;
+	}
+
+	qCritical() << "Failed to open" << filename;
+	return false;
+}
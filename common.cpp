@@ -42,11 +42,59 @@ void writeZeroes(QDataStream& stream, int n) {
 		stream << zero;
 }
 
+int buildEncodeTiles(const QVector<int>& levelPixels, int offset, int bitsPerTexel, QVector<EncodeTile>& tiles) {
+	tiles.clear();
+
+	for (int i=0; i<levelPixels.size(); i++) {
+		const int pixels = levelPixels[i];
+		for (int first=0; first<pixels; first+=ENCODE_TILE_TEXELS) {
+			EncodeTile tile;
+			tile.level = i;
+			tile.first = first;
+			tile.count = qMin(ENCODE_TILE_TEXELS, pixels - first);
+			tile.offset = offset + (first * bitsPerTexel) / 8;
+			tiles.push_back(tile);
+		}
+		offset += qMax(1, (pixels * bitsPerTexel) / 8);
+	}
+
+	return offset;
+}
+
 
 bool isFormat(int textureType, int pixelFormat) {
 	return ((textureType >> PIXELFORMAT_SHIFT) & PIXELFORMAT_MASK) == pixelFormat;
 }
 
+int codebookSize(int textureType) {
+	if (!(textureType & FLAG_COMPRESSED))
+		return 0;
+	return VQ_CODES_MAX - (textureType & VQ_CODES_MASK) * VQ_CODES_STEP;
+}
+
+int codebookSetting(int codes) {
+	return ((VQ_CODES_MAX - codes) / VQ_CODES_STEP) & VQ_CODES_MASK;
+}
+
+int assignCodeSlots(const QVector<bool>& used, bool trim, QVector<int>& codeSlots) {
+	codeSlots.resize(used.size());
+
+	if (!trim) {
+		for (int i=0; i<used.size(); i++)
+			codeSlots[i] = i;
+		return VQ_CODES_MAX;
+	}
+
+	const int usedCodes = used.count(true);
+	int codes = ((usedCodes + VQ_CODES_STEP - 1) / VQ_CODES_STEP) * VQ_CODES_STEP;
+	codes = qBound(VQ_CODES_STEP, codes, VQ_CODES_MAX);
+
+	int next = VQ_CODES_MAX - codes;
+	for (int i=0; i<used.size(); i++)
+		codeSlots[i] = used[i] ? next++ : -1;
+	return codes;
+}
+
 bool isPaletted(int textureType) {
 	return isFormat(textureType, PIXELFORMAT_PAL4BPP) || isFormat(textureType, PIXELFORMAT_PAL8BPP);
 }
@@ -210,7 +258,7 @@ int calculateSize(int w, int h, int textureType) {
 
 	if (mipmapped) {
 		if (compressed) {
-			bytes += 2048;	// Codebook
+			bytes += codebookSize(textureType) * 8;	// Codebook
 			bytes += 1;		// The 1x1 mipmap is never used in vq textures
 			if (is16BPP(textureType)) {
 				// 8x compression
@@ -242,7 +290,7 @@ int calculateSize(int w, int h, int textureType) {
 	} else {
 		const int pixels = getPixelCount(w, h, w, h);
 		if (compressed) {
-			bytes += 2048;	// Codebook
+			bytes += codebookSize(textureType) * 8;	// Codebook
 			if (is16BPP(textureType)) {
 				bytes += pixels / 4;
 			} else if (isFormat(textureType, PIXELFORMAT_PAL4BPP)) {
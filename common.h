@@ -2,9 +2,15 @@
 #define COMMON_H
 
 #include <QColor>
+#include <QVector>
 
 class ImageContainer;
+class QImage;
+class Palette;
 class QDataStream;
+class QRect;
+class QSize;
+struct VQSettings;
 
 #define PIXELFORMAT_ARGB1555	0
 #define PIXELFORMAT_RGB565		1
@@ -27,6 +33,9 @@ class QDataStream;
 #define TEXTURE_STRIDE_MIN	32
 #define TEXTURE_STRIDE_MAX	992
 
+// Amount of VRAM on the PVR2DC. No texture can be larger than this.
+#define VRAM_SIZE			(8 * 1024 * 1024)
+
 // Minimum mipmap sizes
 #define MIN_MIPMAP_VQ		2
 #define MIN_MIPMAP_PALVQ	4
@@ -34,6 +43,12 @@ class QDataStream;
 // Magic identifiers
 #define TEXTURE_MAGIC		"DTEX"
 #define PALETTE_MAGIC		"DPAL"
+#define UVTABLE_MAGIC		"DUVT"
+#define ARCHIVE_MAGIC		"DARC"
+#define LZTEXTURE_MAGIC		"DTLZ"
+
+// Size of the header that comes before the texture header in LZ textures
+#define LZTEXTURE_HEADER_SIZE	8
 
 // Mipmapped uncompressed textures all have a small offset
 // before the actual texture data starts.
@@ -41,6 +56,25 @@ class QDataStream;
 #define MIPMAP_OFFSET_8BPP  3
 #define MIPMAP_OFFSET_16BPP 6
 
+// Uncompressed mipmap levels are encoded in parallel, in tiles of at most
+// this many texels (in twiddled order), straight into their final offset.
+#define ENCODE_TILE_TEXELS	16384
+
+struct EncodeTile {
+	int		level;		// Index of the mipmap level
+	int		first;		// First texel, in twiddled order
+	int		count;		// Number of texels
+	int		offset;		// Byte offset in the output
+};
+
+// Compressed textures can have a codebook with less than 256 codes. The codes
+// that are left out are the first ones, so the texture address can be set to
+// point before the start of the codebook. The number of missing codes divided
+// by VQ_CODES_STEP is stored in bits 0-4 of the type field.
+#define VQ_CODES_MAX		256
+#define VQ_CODES_STEP		8
+#define VQ_CODES_MASK		31
+
 // Returns the nearest higher or equal power of two to x.
 int nextPowerOfTwo(int x);
 
@@ -50,10 +84,25 @@ bool isValidSize(int width, int height, int textureType);
 // Writes n bytes of zeroes to the stream
 void writeZeroes(QDataStream& stream, int n);
 
+// Splits mipmap levels with 'levelPixels' texels each into tiles. The levels
+// are stored after each other starting at 'offset', with 'bitsPerTexel' bits
+// per texel, but always at least one byte per level.
+// Returns the total number of bytes.
+int buildEncodeTiles(const QVector<int>& levelPixels, int offset, int bitsPerTexel, QVector<EncodeTile>& tiles);
+
 bool isFormat(int textureType, int pixelFormat);
 bool isPaletted(int textureType);
 bool is16BPP(int textureType);
 
+// Number of codes in the codebook of a compressed texture
+int codebookSize(int textureType);
+// Returns the type field bits for a codebook with 'codes' codes
+int codebookSetting(int codes);
+// Decides where every code goes in the stored codebook. Without trimming the
+// codes keep their index. With trimming the used codes are packed at the end
+// of the codebook and unused codes get -1. Returns the number of codes stored.
+int assignCodeSlots(const QVector<bool>& used, bool trim, QVector<int>& codeSlots);
+
 // Texel conversion
 quint16	to16BPP(QRgb argb, int pixelFormat);
 QRgb	to32BPP(quint16 argb, int pixelFormat);
@@ -61,6 +110,9 @@ QRgb	to32BPP(quint16 argb, int pixelFormat);
 void RGBtoYUV422(const QRgb rgb1, const QRgb rgb2, quint16& yuv1, quint16& yuv2);
 void YUV422toRGB(const quint16 yuv1, const quint16 yuv2, QRgb& rgb1, QRgb& rgb2);
 
+// Size of the texture data, not counting the header, including the padding.
+int calculateSize(int w, int h, int textureType);
+
 int writeTextureHeader(QDataStream& stream, int width, int height, int textureType);
 
 // Taken from boost. This increases hash performance by A LOT compared to just
@@ -68,12 +120,82 @@ int writeTextureHeader(QDataStream& stream, int width, int height, int textureTy
 uint combineHash(const QRgb& rgba, uint seed);
 
 // conv16bpp.cpp
-void convert16BPP(QDataStream& stream, const ImageContainer& images, int textureType);
+// The converters return the number of codes stored for compressed textures.
+int convert16BPP(QDataStream& stream, const ImageContainer& images, int textureType, const VQSettings& vqSettings);
 
 // convpal.cpp
-void convertPaletted(QDataStream& stream, const ImageContainer& images, int textureType, const QString& paletteFilename);
+// 'colors' is the palette of all colors in 'images'. The palette for the
+// texture is returned in 'palette'.
+int convertPaletted(QDataStream& stream, const ImageContainer& images, const Palette& colors, int textureType, Palette& palette, const VQSettings& vqSettings);
+
+// decoder.cpp
+// The header of a texture file
+struct TextureHeader {
+	int		width;			// The real width, also for stride textures
+	int		height;
+	int		textureType;
+	int		size;			// Size of the texture data after the header
+};
+// Reads the header at the start of 'texture'. Returns false if it isn't one,
+// or if the size is too small for the type or larger than VRAM.
+bool readTextureHeader(const QByteArray& texture, TextureHeader& header);
+// Decodes a texture, header included, into one image per mipmap level from
+// largest to smallest, and/or images that visualize the code usage. Works for
+// every format, and is fast enough to check lots of textures with.
+bool decodeTexture(const QByteArray& texture, const Palette& palette, QVector<QImage>* decoded, QVector<QImage>* codeUsage);
+
+// inspect.cpp
+// What a texture file says about itself, for -info
+struct TextureInfo {
+	QString			archive;		// The archive the texture is in, or empty
+	QString			filename;		// The name in the archive for textures in one
+	qint64			fileSize;		// As stored, compressed for LZ textures
+	bool			lz;				// An LZ texture
+	TextureHeader	header;
+	int				paletteColors;	// -1 if it isn't paletted
+	QString			error;			// Why the file isn't a valid texture, or empty
+};
+// Lists the files in 'paths', and the texture files in directories among
+// them and their subdirectories. 'names' gets the path of each one relative
+// to the directory it was found in, or just the name for files.
+void findTextures(const QStringList& paths, QStringList& filenames, QStringList& names);
+// Looks at the textures in 'filenames', and at every texture in the archives
+// among them. Only the headers of the textures and their palettes are read,
+// so it's fast enough for whole asset directories.
+void inspectTextures(const QStringList& filenames, QVector<TextureInfo>& infos);
+
+// lz.cpp
+// Compresses data to an LZ4 block, with a slower but better match search
+// than LZ4 itself uses.
+QByteArray lzCompress(const QByteArray& data);
+// Decompresses an LZ4 block of 'srcSize' bytes to exactly 'dstSize' bytes.
+// Returns false if the data is broken or doesn't fit.
+bool lzDecompress(const uchar* src, int srcSize, uchar* dst, int dstSize);
+// Turns a texture, header included, into an LZ texture, and back
+QByteArray lzPackTexture(const QByteArray& texture);
+bool lzUnpackTexture(const QByteArray& container, QByteArray& texture);
 
 // preview.cpp
+// Saves the decoded images of a texture in memory, like the one encode()
+// makes, as a preview and/or a code usage image.
+bool generatePreview(const QByteArray& texture, const Palette& palette, const QString& previewFilename, const QString& codeUsageFilename);
+// Same thing for a texture file and its palette file.
 bool generatePreview(const QString& textureFilename, const QString& paletteFilename, const QString& previewFilename, const QString& codeUsageFilename);
 
+// atlas.cpp
+// Packs the images into one image that's a valid size for 'textureType'.
+// Each image gets a gutter of 'padding' pixels that repeats its edges.
+// rects[i] is where the i:th image ended up.
+bool packAtlas(const QStringList& filenames, int textureType, int padding, QImage& atlas, QVector<QRect>& rects);
+// Saves the rectangles of an atlas texture that's 'size' big.
+bool saveUVTable(const QString& filename, const QSize& size, const QVector<QRect>& rects);
+
+// planner.cpp
+// Picks one of 'textureTypes' for every image in 'filenames' so that they fit
+// in 'budget' bytes of VRAM with the least total error, estimated from a
+// sample of each image. The i:th type is called formatNames[i] in the plan.
+// The plan is written to 'manifestFilename' as one line of texconv
+// arguments per image, each ending with 'arguments'.
+bool planTextures(const QStringList& filenames, const QVector<int>& textureTypes, const QStringList& formatNames, qint64 budget, const QString& manifestFilename, const VQSettings& vqSettings, const QString& arguments);
+
 #endif // COMMON_H
@@ -4,90 +4,107 @@
 
 #include <QFile>
 #include <QDebug>
+#include <QSet>
+#include <QtEndian>
+#include <QtConcurrent>
 
-void convertAndWriteTexel(QDataStream& stream, const QRgb& texel, int pixelFormat, bool twiddled);
 void writeStrideData(QDataStream& stream, const QImage& img, int pixelFormat);
 void writeUncompressedData(QDataStream& stream, const ImageContainer& images, int pixelFormat);
-void writeCompressedData(QDataStream& stream, const ImageContainer& images, int pixelFormat);
+int writeCompressedData(QDataStream& stream, const ImageContainer& images, int pixelFormat, const VQSettings& vqSettings);
 
-void convert16BPP(QDataStream& stream, const ImageContainer& images, int textureType) {
+int convert16BPP(QDataStream& stream, const ImageContainer& images, int textureType, const VQSettings& vqSettings) {
 	const int pixelFormat = (textureType >> PIXELFORMAT_SHIFT) & PIXELFORMAT_MASK;
 
 	if (textureType & FLAG_STRIDED) {
 		writeStrideData(stream, images.getByIndex(0), pixelFormat);
 	} else if (textureType & FLAG_COMPRESSED) {
-		writeCompressedData(stream, images, pixelFormat);
+		return writeCompressedData(stream, images, pixelFormat, vqSettings);
 	} else {
 		writeUncompressedData(stream, images, pixelFormat);
 	}
+	return 0;
 }
 
 
-void convertAndWriteTexel(QDataStream& stream, const QRgb& texel, int pixelFormat, bool twiddled) {
-	if (pixelFormat == PIXELFORMAT_YUV422) {
-		static int index = 0;
-		static QRgb savedTexel[3];
-
-		if (!twiddled && index == 1) {
-			quint16 yuv[2];
-			RGBtoYUV422(savedTexel[0], texel, yuv[0], yuv[1]);
-			stream << yuv[0];
-			stream << yuv[1];
-			index = 0;
-		} else if (twiddled && index == 3) {
-			quint16 yuv[4];
-			RGBtoYUV422(savedTexel[0], savedTexel[2], yuv[0], yuv[2]);
-			RGBtoYUV422(savedTexel[1],         texel, yuv[1], yuv[3]);
-			stream << yuv[0];
-			stream << yuv[1];
-			stream << yuv[2];
-			stream << yuv[3];
-			index = 0;
+void writeStrideData(QDataStream& stream, const QImage& img, int pixelFormat) {
+	for (int y=0; y<img.height(); y++) {
+		if (pixelFormat == PIXELFORMAT_YUV422) {
+			// Two texels at a time, since they share their U and V
+			for (int x=0; x<img.width(); x+=2) {
+				quint16 yuv[2];
+				RGBtoYUV422(img.pixel(x, y), img.pixel(x + 1, y), yuv[0], yuv[1]);
+				stream << yuv[0];
+				stream << yuv[1];
+			}
 		} else {
-			savedTexel[index] = texel;
-			index++;
+			for (int x=0; x<img.width(); x++)
+				stream << to16BPP(img.pixel(x, y), pixelFormat);
 		}
-	} else {
-		stream << to16BPP(texel, pixelFormat);
 	}
 }
 
-void writeStrideData(QDataStream& stream, const QImage& img, int pixelFormat) {
-	for (int y=0; y<img.height(); y++)
-		for (int x=0; x<img.width(); x++)
-			convertAndWriteTexel(stream, img.pixel(x, y), pixelFormat, false);
-}
-
-void writeUncompressedData(QDataStream& stream, const ImageContainer& images, int pixelFormat) {
-	// Mipmap offset
-	if (images.hasMipmaps()) {
-		writeZeroes(stream, MIPMAP_OFFSET_16BPP);
+// Encodes one tile of a mipmap level in twiddled order.
+static void encodeTile(const QImage& img, const Twiddler& twiddler, int pixelFormat, const EncodeTile& tile, quint8* dst) {
+	// The 1x1 mipmap level is a bit special for YUV textures. Since there's only
+	// one pixel, it can't be saved as YUV422, so save it as RGB565 instead.
+	if (img.width() == 1 && img.height() == 1 && pixelFormat == PIXELFORMAT_YUV422) {
+		qToLittleEndian<quint16>(to16BPP(img.pixel(0, 0), PIXELFORMAT_RGB565), dst);
+		return;
 	}
 
-	// Texture data, from smallest to largest mipmap
-	for (int i=0; i<images.imageCount(); i++) {
-		const QImage& img = images.getByIndex(i);
-
-		// The 1x1 mipmap level is a bit special for YUV textures. Since there's only
-		// one pixel, it can't be saved as YUV422, so save it as RGB565 instead.
-		if (img.width() == 1 && img.height() == 1 && pixelFormat == PIXELFORMAT_YUV422) {
-			convertAndWriteTexel(stream, img.pixel(0, 0), PIXELFORMAT_RGB565, true);
-			continue;
-		}
+	const int last = tile.first + tile.count;
 
-		const Twiddler twiddler(img.width(), img.height());
-		const int pixels = img.width() * img.height();
+	if (pixelFormat == PIXELFORMAT_YUV422) {
+		// Four twiddled texels make up a 2x2 block, where the top and
+		// bottom pairs share their U and V. Tiles always start on a block.
+		for (int j=tile.first; j<last; j+=4) {
+			QRgb texel[4];
+			for (int k=0; k<4; k++) {
+				const int index = twiddler.index(j + k);
+				texel[k] = img.pixel(index % img.width(), index / img.width());
+			}
 
-		// Write all texels for this mipmap level in twiddled order
-		for (int j=0; j<pixels; j++) {
+			quint16 yuv[4];
+			RGBtoYUV422(texel[0], texel[2], yuv[0], yuv[2]);
+			RGBtoYUV422(texel[1], texel[3], yuv[1], yuv[3]);
+			for (int k=0; k<4; k++, dst+=2)
+				qToLittleEndian<quint16>(yuv[k], dst);
+		}
+	} else {
+		for (int j=tile.first; j<last; j++, dst+=2) {
 			const int index = twiddler.index(j);
 			const int x = index % img.width();
 			const int y = index / img.width();
-			convertAndWriteTexel(stream, img.pixel(x, y), pixelFormat, true);
+			qToLittleEndian<quint16>(to16BPP(img.pixel(x, y), pixelFormat), dst);
 		}
 	}
 }
 
+void writeUncompressedData(QDataStream& stream, const ImageContainer& images, int pixelFormat) {
+	// Texture data, from smallest to largest mipmap, after the mipmap offset
+	QVector<QImage> levels;
+	QVector<const Twiddler*> twiddlers;
+	QVector<int> levelPixels;
+	for (int i=0; i<images.imageCount(); i++) {
+		const QImage img = images.getByIndex(i);
+		levels.push_back(img);
+		twiddlers.push_back(&Twiddler::shared(img.width(), img.height()));
+		levelPixels.push_back(img.width() * img.height());
+	}
+
+	// Every level and tile knows where it goes, so they're all encoded at once
+	QVector<EncodeTile> tiles;
+	const int offset = images.hasMipmaps() ? MIPMAP_OFFSET_16BPP : 0;
+	QByteArray data(buildEncodeTiles(levelPixels, offset, 16, tiles), 0);
+	quint8* out = (quint8*)data.data();
+
+	QtConcurrent::blockingMap(tiles, [&levels, &twiddlers, pixelFormat, out](const EncodeTile& tile) {
+		encodeTile(levels[tile.level], *twiddlers[tile.level], pixelFormat, tile, out + tile.offset);
+	});
+
+	stream.writeRawData(data.constData(), data.size());
+}
+
 // Packs a quad (2x2 16BPP texels) into a single quint64
 static quint64 packQuad(QRgb topLeft, QRgb topRight, QRgb bottomLeft, QRgb bottomRight, int pixelFormat) {
 	quint64 a, b, c, d;
@@ -166,9 +183,22 @@ static int encodeLossless(const ImageContainer& images, int pixelFormat, QVector
 	return uniqueQuads.size();
 }
 
+// Number of 2x2 pixel blocks that will be vectorized.
+static int countBlocks(const ImageContainer& images) {
+	int count = 0;
+	for (int i=0; i<images.imageCount(); i++) {
+		const QImage& img = images.getByIndex(i);
+		if (img.width() >= MIN_MIPMAP_VQ && img.height() >= MIN_MIPMAP_VQ)
+			count += (img.width() / 2) * (img.height() / 2);
+	}
+	return count;
+}
+
 // Divides the image into 2x2 pixel blocks and stores them as 12-dimensional
 // vectors, (R, G, B) * 4.
-static void vectorizeRGB(const ImageContainer& images, QVector<Vec<12>>& vectors) {
+static void vectorizeRGB(const ImageContainer& images, VecStore<12>& vectors) {
+	vectors.reserve(countBlocks(images));
+
 	for (int i=0; i<images.imageCount(); i++) {
 		const QImage& img = images.getByIndex(i);
 
@@ -189,8 +219,7 @@ static void vectorizeRGB(const ImageContainer& images, QVector<Vec<12>>& vectors
 						offset += 3;
 					}
 				}
-				vec.setHash(hash);
-				vectors.push_back(vec);
+				vectors.push_back(vec, hash);
 			}
 		}
 	}
@@ -198,7 +227,9 @@ static void vectorizeRGB(const ImageContainer& images, QVector<Vec<12>>& vectors
 
 // Divides the image into 2x2 pixel blocks and stores them as 16-dimensional
 // vectors, (A, R, G, B) * 4.
-static void vectorizeARGB(const ImageContainer& images, QVector<Vec<16>>& vectors) {
+static void vectorizeARGB(const ImageContainer& images, VecStore<16>& vectors) {
+	vectors.reserve(countBlocks(images));
+
 	for (int i=0; i<images.imageCount(); i++) {
 		const QImage& img = images.getByIndex(i);
 
@@ -219,14 +250,92 @@ static void vectorizeARGB(const ImageContainer& images, QVector<Vec<16>>& vector
 						offset += 4;
 					}
 				}
-				vec.setHash(hash);
-				vectors.push_back(vec);
+				vectors.push_back(vec, hash);
+			}
+		}
+	}
+}
+
+// How the bytes of a pair of stored texels map to vector components while
+// training. Each byte is rotated by an offset (mod 256), then scaled by a
+// weight, so distances between vectors follow the error in the output.
+struct TexelSpace {
+	float	weights[4];
+	int		offsets[4];
+};
+
+static TexelSpace texelSpace(const QVector<quint64>& quads, int pixelFormat) {
+	TexelSpace space = { { 1.0f, 1.0f, 1.0f, 1.0f }, { 0, 0, 0, 0 } };
+
+	if (pixelFormat == PIXELFORMAT_YUV422) {
+		// (Y, U, Y, V). An error in U or V costs more than one in Y once
+		// converted back to RGB, since they're shared by two pixels and get
+		// amplified by the conversion.
+		space.weights[1] = 1.43f;
+		space.weights[3] = 1.25f;
+	} else if (pixelFormat == PIXELFORMAT_BUMPMAP) {
+		// (S, R, S, R). R is an angle that wraps around, so rotate it to put
+		// the wrap where the fewest texels are. One step of R turns the normal
+		// 4 times as far as one step of S, but only by the sine of the angle
+		// to the vertical, so weight it by that.
+		QVector<int> histogram(256, 0);
+		double sinSquared = 0;
+		for (int i=0; i<quads.size(); i++) {
+			for (int j=0; j<4; j++) {
+				const quint16 texel = (quint16)(quads[i] >> (j * 16));
+				const float polar = (1.0f - (texel >> 8) / 255.0f) * (M_PI / 2.0);
+				sinSquared += sin(polar) * sin(polar);
+				histogram[texel & 0xFF]++;
 			}
 		}
+
+		int emptiest = 0;
+		for (int i=1; i<256; i++)
+			if (histogram[i] < histogram[emptiest])
+				emptiest = i;
+		space.offsets[1] = space.offsets[3] = (emptiest + 1) & 0xFF;
+
+		const float weight = qMax(0.05f, 4.0f * (float)sqrt(sinSquared / qMax(1, quads.size() * 4)));
+		space.weights[1] = space.weights[3] = weight;
+	}
+
+	return space;
+}
+
+// Divides the image into 2x2 pixel blocks, converts them to the 16-bit texels
+// they'll be stored as, and stores the bytes of those texels as 8-dimensional
+// vectors. For YUV422 that's (Y, U, Y, V) * 2, and for BUMPMAP (S, R) * 4.
+static void vectorizeTexels(const ImageContainer& images, int pixelFormat, TexelSpace& space, VecStore<8>& vectors) {
+	QVector<quint64> quads;
+	quads.reserve(countBlocks(images));
+
+	for (int i=0; i<images.imageCount(); i++) {
+		const QImage& img = images.getByIndex(i);
+
+		// Ignore images smaller than this
+		if (img.width() < MIN_MIPMAP_VQ || img.height() < MIN_MIPMAP_VQ)
+			continue;
+
+		for (int y=0; y<img.height(); y+=2)
+			for (int x=0; x<img.width(); x+=2)
+				quads.push_back(packQuad(img.pixel(x, y), img.pixel(x + 1, y), img.pixel(x, y + 1), img.pixel(x + 1, y + 1), pixelFormat));
+	}
+
+	space = texelSpace(quads, pixelFormat);
+
+	vectors.reserve(quads.size());
+	for (int i=0; i<quads.size(); i++) {
+		Vec<8> vec;
+		for (int j=0; j<8; j++) {
+			const int value = ((quads[i] >> (56 - j * 8)) - space.offsets[j % 4]) & 0xFF;
+			vec.set(j, value / 255.0f * space.weights[j % 4]);
+		}
+		vectors.push_back(vec, qHash(quads[i]));
 	}
 }
 
-static void devectorizeRGB(const ImageContainer& srcImages, const QVector<Vec<12>>& vectors, const VectorQuantizer<12>& vq, int pixelFormat, QVector<QImage>& indexedImages, QVector<quint64>& codebook) {
+// Turns the code indices for all 2x2 blocks back into one image per mipmap level.
+static void buildIndexedImages(const ImageContainer& srcImages, const QVector<int>& indices, QVector<QImage>& indexedImages) {
 	int vindex = 0;
 
 	for (int i=0; i<srcImages.imageCount(); i++) {
@@ -237,14 +346,18 @@ static void devectorizeRGB(const ImageContainer& srcImages, const QVector<Vec<12
 		img.setColorCount(256);
 		for (int y=0; y<img.height(); y++) {
 			for (int x=0; x<img.width(); x++) {
-				const Vec<12>& vec = vectors[vindex];
-				int codeIndex = vq.findClosest(vec);
-				img.setPixel(x, y, codeIndex);
+				img.setPixel(x, y, indices[vindex]);
 				vindex++;
 			}
 		}
 		indexedImages.push_back(img);
 	}
+}
+
+static void devectorizeRGB(const ImageContainer& srcImages, const VecStore<12>& vectors, const VectorQuantizer<12>& vq, int pixelFormat, QVector<QImage>& indexedImages, QVector<quint64>& codebook) {
+	QVector<int> indices;
+	vq.findClosest(vectors, indices);
+	buildIndexedImages(srcImages, indices, indexedImages);
 
 	for (int i=0; i<vq.codeCount(); i++) {
 		const Vec<12>& vec = vq.codeVector(i);
@@ -257,25 +370,10 @@ static void devectorizeRGB(const ImageContainer& srcImages, const QVector<Vec<12
 	}
 }
 
-static void devectorizeARGB(const ImageContainer& srcImages, const QVector<Vec<16>>& vectors, const VectorQuantizer<16>& vq, int format, QVector<QImage>& indexedImages, QVector<quint64>& codebook) {
-	int vindex = 0;
-
-	for (int i=0; i<srcImages.imageCount(); i++) {
-		const QSize size = srcImages.getByIndex(i).size();
-		if (size.width() == 1 || size.height() == 1)
-			continue;
-		QImage img(size.width()/2, size.height()/2, QImage::Format_Indexed8);
-		img.setColorCount(256);
-		for (int y=0; y<img.height(); y++) {
-			for (int x=0; x<img.width(); x++) {
-				const Vec<16>& vec = vectors[vindex];
-				int codeIndex = vq.findClosest(vec);
-				img.setPixel(x, y, codeIndex);
-				vindex++;
-			}
-		}
-		indexedImages.push_back(img);
-	}
+static void devectorizeARGB(const ImageContainer& srcImages, const VecStore<16>& vectors, const VectorQuantizer<16>& vq, int format, QVector<QImage>& indexedImages, QVector<quint64>& codebook) {
+	QVector<int> indices;
+	vq.findClosest(vectors, indices);
+	buildIndexedImages(srcImages, indices, indexedImages);
 
 	for (int i=0; i<vq.codeCount(); i++) {
 		const Vec<16>& vec = vq.codeVector(i);
@@ -288,43 +386,219 @@ static void devectorizeARGB(const ImageContainer& srcImages, const QVector<Vec<1
 	}
 }
 
-void writeCompressedData(QDataStream& stream, const ImageContainer& images, int pixelFormat) {
+static void devectorizeTexels(const ImageContainer& srcImages, const VecStore<8>& vectors, const VectorQuantizer<8>& vq, const TexelSpace& space, QVector<QImage>& indexedImages, QVector<quint64>& codebook) {
+	QVector<int> indices;
+	vq.findClosest(vectors, indices);
+	buildIndexedImages(srcImages, indices, indexedImages);
+
+	for (int i=0; i<vq.codeCount(); i++) {
+		const Vec<8>& vec = vq.codeVector(i);
+		quint64 quad = 0;
+		for (int j=0; j<8; j++) {
+			const int value = qBound(0, (int)(vec[j] / space.weights[j % 4] * 255.0f + 0.5f), 255);
+			quad |= ((quint64)((value + space.offsets[j % 4]) & 0xFF)) << (56 - j * 8);
+		}
+		codebook.push_back(quad);
+	}
+}
+
+// The ARGB1555 alpha bits of a 2x2 block, top left pixel in the highest bit.
+static int alphaMask(QRgb tl, QRgb tr, QRgb bl, QRgb br) {
+	return ((qAlpha(tl) >= 128) ? 8 : 0) | ((qAlpha(tr) >= 128) ? 4 : 0) | ((qAlpha(bl) >= 128) ? 2 : 0) | ((qAlpha(br) >= 128) ? 1 : 0);
+}
+
+// ARGB1555 has a single bit of alpha, so a 2x2 block has one of only 16
+// alpha masks. The blocks are sorted into one bucket per mask and each bucket
+// gets its own 12-dimensional RGB codebook, so a block can never pick up a
+// code with different transparency. The codes are shared between the
+// buckets to minimize the total error.
+// Returns false if there are more buckets in use than codes.
+static bool compressARGB1555(const ImageContainer& images, const VQSettings& vqSettings, QVector<QImage>& indexedImages, QVector<quint64>& codebook) {
+	const int BUCKETS = 16;
+	QVector<VecStore<12>> vectors(BUCKETS);
+	QVector<int> blockMasks;
+	blockMasks.reserve(countBlocks(images));
+
+	for (int i=0; i<images.imageCount(); i++) {
+		const QImage& img = images.getByIndex(i);
+
+		// Ignore images smaller than this
+		if (img.width() < MIN_MIPMAP_VQ || img.height() < MIN_MIPMAP_VQ)
+			continue;
+
+		for (int y=0; y<img.height(); y+=2) {
+			for (int x=0; x<img.width(); x+=2) {
+				const QRgb pixels[4] = { img.pixel(x, y), img.pixel(x + 1, y), img.pixel(x, y + 1), img.pixel(x + 1, y + 1) };
+				const int mask = alphaMask(pixels[0], pixels[1], pixels[2], pixels[3]);
+				Vec<12> vec;
+				uint hash = 0;
+				for (int j=0; j<4; j++) {
+					rgb2vec(pixels[j], vec, j * 3);
+					hash = combineHash(pixels[j], hash);
+				}
+				vectors[mask].push_back(vec, hash);
+				blockMasks.push_back(mask);
+			}
+		}
+	}
+
+	// Estimate the error of every bucket with a single code, and how many
+	// different vectors it has.
+	QVector<double> errors(BUCKETS, 0.0);
+	QVector<int> uniqueCounts(BUCKETS, 0);
+	for (int b=0; b<BUCKETS; b++) {
+		const VecStore<12>& bucket = vectors[b];
+		if (bucket.isEmpty())
+			continue;
+		Vec<12> mean;
+		mean.zero();
+		for (int i=0; i<bucket.size(); i++)
+			mean += bucket[i];
+		mean /= (float)bucket.size();
+		for (int i=0; i<bucket.size(); i++)
+			errors[b] += Vec<12>::distanceSquared(bucket[i], mean);
+
+		QSet<uint> hashes;
+		for (int i=0; i<bucket.size(); i++)
+			hashes.insert(bucket.hash(i));
+		uniqueCounts[b] = hashes.size();
+	}
+
+	// Every bucket in use needs at least one code. Hand out the rest one at a
+	// time to the bucket where it removes the most error, assuming the error
+	// of a bucket falls off as codes^(-2/12), like it does for a well trained
+	// 12-dimensional codebook.
+	QVector<int> numCodes(BUCKETS, 0);
+	int codesLeft = vqSettings.codes;
+	for (int b=0; b<BUCKETS; b++) {
+		if (!vectors[b].isEmpty()) {
+			numCodes[b] = 1;
+			codesLeft--;
+		}
+	}
+	if (codesLeft < 0) {
+		qDebug() << "More alpha masks than codes, not partitioning by alpha";
+		return false;
+	}
+	for (; codesLeft>0; codesLeft--) {
+		int best = -1;
+		double bestGain = 0;
+		for (int b=0; b<BUCKETS; b++) {
+			if (numCodes[b] == 0 || numCodes[b] >= uniqueCounts[b])
+				continue;
+			const double gain = errors[b] * (pow(numCodes[b], -2.0 / 12.0) - pow(numCodes[b] + 1, -2.0 / 12.0));
+			if (best == -1 || gain > bestGain) {
+				best = b;
+				bestGain = gain;
+			}
+		}
+		if (best == -1)
+			break;
+		numCodes[best]++;
+	}
+
+	// Train every bucket and put the codes after each other in the codebook
+	QVector<QVector<int>> indices(BUCKETS);
+	QVector<int> firstCode(BUCKETS, 0);
+	for (int b=0; b<BUCKETS; b++) {
+		if (numCodes[b] == 0)
+			continue;
+
+		qDebug() << "Alpha mask" << b << ":" << vectors[b].size() << "blocks," << numCodes[b] << "codes";
+		VectorQuantizer<12> vq(vqSettings);
+		vq.compress(vectors[b], numCodes[b]);
+		vq.findClosest(vectors[b], indices[b]);
+
+		firstCode[b] = codebook.size();
+		for (int i=0; i<vq.codeCount(); i++) {
+			const Vec<12>& vec = vq.codeVector(i);
+			QRgb pixels[4];
+			for (int j=0; j<4; j++) {
+				const QColor color = QColor::fromRgbF(vec[j * 3 + 0], vec[j * 3 + 1], vec[j * 3 + 2], (b & (8 >> j)) ? 1.0 : 0.0);
+				pixels[j] = color.rgba();
+			}
+			codebook.push_back(packQuad(pixels[0], pixels[1], pixels[2], pixels[3], PIXELFORMAT_ARGB1555));
+		}
+	}
+
+	// Map the blocks back to the shared codebook, in their original order
+	QVector<int> codeIndices(blockMasks.size());
+	QVector<int> next(BUCKETS, 0);
+	for (int i=0; i<blockMasks.size(); i++) {
+		const int b = blockMasks[i];
+		codeIndices[i] = firstCode[b] + indices[b][next[b]++];
+	}
+	buildIndexedImages(images, codeIndices, indexedImages);
+	return true;
+}
+
+int writeCompressedData(QDataStream& stream, const ImageContainer& images, int pixelFormat, const VQSettings& vqSettings) {
 	QVector<QImage> indexedImages;
 	QVector<quint64> codebook;
 
-	const int numQuads = encodeLossless(images, pixelFormat, indexedImages, codebook, 256);
+	const int numQuads = encodeLossless(images, pixelFormat, indexedImages, codebook, vqSettings.codes);
 
 	qDebug() << "Source images contain" << numQuads << "unique quads";
 
-	if (numQuads > 256) {
-		if ((pixelFormat != PIXELFORMAT_ARGB1555) && (pixelFormat != PIXELFORMAT_ARGB4444)) {
-			QVector<Vec<12>> vectors;
-			VectorQuantizer<12> vq;
+	if (numQuads > vqSettings.codes) {
+		const bool texelFormat = (pixelFormat == PIXELFORMAT_YUV422) || (pixelFormat == PIXELFORMAT_BUMPMAP);
+		if (texelFormat && vqSettings.trainOnTexels) {
+			// Train on the values that are actually stored, instead of on
+			// RGB and converting afterwards.
+			TexelSpace space;
+			VecStore<8> vectors;
+			VectorQuantizer<8> vq(vqSettings);
+			vectorizeTexels(images, pixelFormat, space, vectors);
+			vq.compress(vectors, vqSettings.codes);
+			devectorizeTexels(images, vectors, vq, space, indexedImages, codebook);
+		} else if (pixelFormat == PIXELFORMAT_ARGB1555 && compressARGB1555(images, vqSettings, indexedImages, codebook)) {
+			// Every alpha mask got its own codes
+		} else if ((pixelFormat == PIXELFORMAT_RGB565) || texelFormat) {
+			VecStore<12> vectors;
+			VectorQuantizer<12> vq(vqSettings);
 			vectorizeRGB(images, vectors);
-			vq.compress(vectors, 256);
+			vq.compress(vectors, vqSettings.codes);
 			devectorizeRGB(images, vectors, vq, pixelFormat, indexedImages, codebook);
 		} else {
-			QVector<Vec<16>> vectors;
-			VectorQuantizer<16> vq;
+			VecStore<16> vectors;
+			VectorQuantizer<16> vq(vqSettings);
 			vectorizeARGB(images, vectors);
-			vq.compress(vectors, 256);
+			vq.compress(vectors, vqSettings.codes);
 			devectorizeARGB(images, vectors, vq, pixelFormat, indexedImages, codebook);
 		}
 	}
 
+	// Find out where every code goes in the stored codebook
+	QVector<bool> used(codebook.size(), !vqSettings.trimCodebook);
+	if (vqSettings.trimCodebook) {
+		for (int i=0; i<indexedImages.size(); i++) {
+			const QImage& img = indexedImages[i];
+			for (int y=0; y<img.height(); y++)
+				for (int x=0; x<img.width(); x++)
+					used[img.pixelIndex(x, y)] = true;
+		}
+	}
+	QVector<int> codeSlots;
+	const int storedCodes = assignCodeSlots(used, vqSettings.trimCodebook, codeSlots);
+	const int firstSlot = VQ_CODES_MAX - storedCodes;
+	if (vqSettings.trimCodebook)
+		qDebug() << "Storing" << storedCodes << "codes";
+
 	// Build the codebook
 	quint16 codes[256 * 4];
 	memset(codes, 0, 2048);
 	for (int i=0; i<codebook.size(); i++) {
+		if (codeSlots[i] < 0)
+			continue;
 		const quint64& quad = codebook[i];
-		codes[i * 4 + 0] = (quint16)((quad >> 48) & 0xFFFF);
-		codes[i * 4 + 1] = (quint16)((quad >> 16) & 0xFFFF);
-		codes[i * 4 + 2] = (quint16)((quad >> 32) & 0xFFFF);
-		codes[i * 4 + 3] = (quint16)((quad >>  0) & 0xFFFF);
+		codes[codeSlots[i] * 4 + 0] = (quint16)((quad >> 48) & 0xFFFF);
+		codes[codeSlots[i] * 4 + 1] = (quint16)((quad >> 16) & 0xFFFF);
+		codes[codeSlots[i] * 4 + 2] = (quint16)((quad >> 32) & 0xFFFF);
+		codes[codeSlots[i] * 4 + 3] = (quint16)((quad >>  0) & 0xFFFF);
 	}
 
 	// Write the codebook
-	for (int i=0; i<1024; i++)
+	for (int i=firstSlot*4; i<1024; i++)
 		stream << codes[i];
 
 	// Write the 1x1 mipmap level
@@ -334,14 +608,16 @@ void writeCompressedData(QDataStream& stream, const ImageContainer& images, int
 	// Write all mipmap levels
 	for (int i=0; i<indexedImages.size(); i++) {
 		const QImage& img = indexedImages[i];
-		const Twiddler twiddler(img.width(), img.height());
+		const Twiddler& twiddler = Twiddler::shared(img.width(), img.height());
 		const int pixels = img.width() * img.height();
 
 		for (int j=0; j<pixels; j++) {
 			const int index = twiddler.index(j);
 			const int x = index % img.width();
 			const int y = index / img.width();
-			stream << (quint8)img.pixelIndex(x, y);
+			stream << (quint8)codeSlots[img.pixelIndex(x, y)];
 		}
 	}
+
+	return storedCodes;
 }
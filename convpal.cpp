@@ -7,31 +7,32 @@
 #include <QFile>
 #include <QPainter>
 #include <QThread>
+#include <QtConcurrent>
 
-static void vectorizeARGB(const ImageContainer& images, QVector<Vec<4>>& vectors) {
+static void vectorizeARGB(const ImageContainer& images, VecStore<4>& vectors) {
 	for (int i=0; i<images.imageCount(); i++) {
 		const QImage& img = images.getByIndex(i);
 		for (int y=0; y<img.height(); y++) {
 			for (int x=0; x<img.width(); x++) {
 				const QRgb pixel = img.pixel(x, y);
-				Vec<4> vec(pixel);
+				Vec<4> vec;
 				argb2vec(pixel, vec);
-				vectors.push_back(vec);
+				vectors.push_back(vec, pixel);
 			}
 		}
 	}
 }
 
-static void devectorizeARGB(const ImageContainer& srcImages, const QVector<Vec<4>>& vectors, const VectorQuantizer<4>& vq, QVector<QImage>& indexedImages, Palette& palette) {
+static void devectorizeARGB(const ImageContainer& srcImages, const VecStore<4>& vectors, const VectorQuantizer<4>& vq, QVector<QImage>& indexedImages, Palette& palette) {
+	QVector<int> indices;
+	vq.findClosest(vectors, indices);
 	int vindex = 0;
 	for (int i=0; i<srcImages.imageCount(); i++) {
 		const QImage& srcImg = srcImages.getByIndex(i);
 		QImage dstImg(srcImg.size(), QImage::Format_ARGB32);
 		for (int y=0; y<dstImg.height(); y++) {
 			for (int x=0; x<dstImg.width(); x++) {
-				const Vec<4>& vec = vectors[vindex];
-				int codeIndex = vq.findClosest(vec);
-				dstImg.setPixel(x, y, codeIndex);
+				dstImg.setPixel(x, y, indices[vindex]);
 				vindex++;
 			}
 		}
@@ -49,8 +50,8 @@ void convertToIndexedImages(const ImageContainer& src, const Palette& pal, QVect
 void writeUncompressed4BPPData(QDataStream& stream, const QVector<QImage>& indexedImages);
 void writeUncompressed8BPPData(QDataStream& stream, const QVector<QImage>& indexedImages);
 void writeUncompressedPreview(const QString& filename, const QVector<QImage>& indexedImages, const Palette& palette);
-void writeCompressed4BPPData(QDataStream& stream, const QVector<QImage>& indexedImages, const Palette& palette);
-void writeCompressed8BPPData(QDataStream& stream, const QVector<QImage>& indexedImages, const Palette& palette);
+int writeCompressed4BPPData(QDataStream& stream, const QVector<QImage>& indexedImages, const Palette& palette, const VQSettings& vqSettings);
+int writeCompressed8BPPData(QDataStream& stream, const QVector<QImage>& indexedImages, const Palette& palette, const VQSettings& vqSettings);
 
 /*
  * This conversion basically has three modes:
@@ -68,9 +69,9 @@ void writeCompressed8BPPData(QDataStream& stream, const QVector<QImage>& indexed
  *    with a vector dimension of 32 or 64 (2x4 or 4x4 pixel blocks).
  */
 
-void convertPaletted(QDataStream& stream, const ImageContainer& images, int textureType, const QString& paletteFilename) {
+int convertPaletted(QDataStream& stream, const ImageContainer& images, const Palette& colors, int textureType, Palette& palette, const VQSettings& vqSettings) {
 	const int maxColors = isFormat(textureType, PIXELFORMAT_PAL4BPP) ? 16 : 256;
-	Palette palette(images);
+	palette = colors;
 	QVector<QImage> indexedImages;
 
 	qDebug("Palette contains %d colors", palette.colorCount());
@@ -80,8 +81,8 @@ void convertPaletted(QDataStream& stream, const ImageContainer& images, int text
 		// the color count down to what we need.
 		qDebug("Reducing palette to %d colors", maxColors);
 		palette.clear();
-		VectorQuantizer<4> vq;
-		QVector<Vec<4>> vectors;
+		VectorQuantizer<4> vq(vqSettings);
+		VecStore<4> vectors;
 		vectorizeARGB(images, vectors);
 		vq.compress(vectors, maxColors);
 		devectorizeARGB(images, vectors, vq, indexedImages, palette);
@@ -91,21 +92,19 @@ void convertPaletted(QDataStream& stream, const ImageContainer& images, int text
 		convertToIndexedImages(images, palette, indexedImages);
 	}
 
-	// The palette is finished now, so save it.
-	palette.save(paletteFilename);
-
 	// Write data
 	if (textureType & FLAG_COMPRESSED) {
 		if (isFormat(textureType, PIXELFORMAT_PAL4BPP))
-			writeCompressed4BPPData(stream, indexedImages, palette);
+			return writeCompressed4BPPData(stream, indexedImages, palette, vqSettings);
 		if (isFormat(textureType, PIXELFORMAT_PAL8BPP))
-			writeCompressed8BPPData(stream, indexedImages, palette);
+			return writeCompressed8BPPData(stream, indexedImages, palette, vqSettings);
 	} else {
 		if (isFormat(textureType, PIXELFORMAT_PAL4BPP))
 			writeUncompressed4BPPData(stream, indexedImages);
 		if (isFormat(textureType, PIXELFORMAT_PAL8BPP))
 			writeUncompressed8BPPData(stream, indexedImages);
 	}
+	return 0;
 }
 
 
@@ -122,29 +121,42 @@ void convertToIndexedImages(const ImageContainer& src, const Palette& pal, QVect
 	}
 }
 
-void writeUncompressed4BPPData(QDataStream& stream, const QVector<QImage>& indexedImages) {
-	// Write mipmap offset if necessary
-	if (indexedImages.size() > 1)
-		writeZeroes(stream, MIPMAP_OFFSET_4BPP);
-
-	// Write all mipmaps from smallest to largest
+// Gets a twiddler for every mipmap level and the tiles to encode them in.
+// Returns the total number of bytes.
+static int prepareTiles(const QVector<QImage>& indexedImages, int offset, int bitsPerTexel, QVector<const Twiddler*>& twiddlers, QVector<EncodeTile>& tiles) {
+	QVector<int> levelPixels;
 	for (int i=0; i<indexedImages.size(); i++) {
 		const QImage& img = indexedImages[i];
+		twiddlers.push_back(&Twiddler::shared(img.width(), img.height()));
+		levelPixels.push_back(img.width() * img.height());
+	}
+	return buildEncodeTiles(levelPixels, offset, bitsPerTexel, tiles);
+}
+
+void writeUncompressed4BPPData(QDataStream& stream, const QVector<QImage>& indexedImages) {
+	// All mipmaps from smallest to largest, after the mipmap offset if necessary
+	QVector<const Twiddler*> twiddlers;
+	QVector<EncodeTile> tiles;
+	const int offset = (indexedImages.size() > 1) ? MIPMAP_OFFSET_4BPP : 0;
+	QByteArray data(prepareTiles(indexedImages, offset, 4, twiddlers, tiles), 0);
+	quint8* out = (quint8*)data.data();
+
+	QtConcurrent::blockingMap(tiles, [&indexedImages, &twiddlers, out](const EncodeTile& tile) {
+		const QImage& img = indexedImages[tile.level];
+		quint8* dst = out + tile.offset;
 
 		// Special case. There's only one pixel in the 1x1 mipmap level,
 		// but it's stored by itself in one byte.
 		if (img.width() == 1) {
-			stream << (quint8)img.pixel(0, 0);
-			continue;
+			*dst = (quint8)img.pixel(0, 0);
+			return;
 		}
 
-		Twiddler twiddler(img.width(), img.height());
-		const int pixels = img.width() * img.height();
-
 		// Write all pixels in pairs
 		// First pixel in the least significant nibble.
 		// Second pixel in the most significant nibble.
-		for (int j=0; j<pixels; j+=2) {
+		const Twiddler& twiddler = *twiddlers[tile.level];
+		for (int j=tile.first; j<tile.first+tile.count; j+=2) {
 			quint8 palindex[2];
 
 			for (int k=0; k<2; k++) {
@@ -154,30 +166,35 @@ void writeUncompressed4BPPData(QDataStream& stream, const QVector<QImage>& index
 				palindex[k] = (quint8)img.pixel(x, y);
 			}
 
-			stream << (quint8)(((palindex[1] & 0xF) << 4) | (palindex[0] & 0xF));
+			*dst++ = (quint8)(((palindex[1] & 0xF) << 4) | (palindex[0] & 0xF));
 		}
-	}
+	});
+
+	stream.writeRawData(data.constData(), data.size());
 }
 
 void writeUncompressed8BPPData(QDataStream& stream, const QVector<QImage>& indexedImages) {
-	// Write mipmap offset if necessary
-	if (indexedImages.size() > 1)
-		writeZeroes(stream, MIPMAP_OFFSET_8BPP);
-
-	// Write all mipmaps from smallest to largest
-	for (int i=0; i<indexedImages.size(); i++) {
-		const QImage& img = indexedImages[i];
-
-		Twiddler twiddler(img.width(), img.height());
-		const int pixels = img.width() * img.height();
-
-		for (int j=0; j<pixels; j++) {
+	// All mipmaps from smallest to largest, after the mipmap offset if necessary
+	QVector<const Twiddler*> twiddlers;
+	QVector<EncodeTile> tiles;
+	const int offset = (indexedImages.size() > 1) ? MIPMAP_OFFSET_8BPP : 0;
+	QByteArray data(prepareTiles(indexedImages, offset, 8, twiddlers, tiles), 0);
+	quint8* out = (quint8*)data.data();
+
+	QtConcurrent::blockingMap(tiles, [&indexedImages, &twiddlers, out](const EncodeTile& tile) {
+		const QImage& img = indexedImages[tile.level];
+		const Twiddler& twiddler = *twiddlers[tile.level];
+		quint8* dst = out + tile.offset;
+
+		for (int j=tile.first; j<tile.first+tile.count; j++) {
 			const int index = twiddler.index(j);
 			const int x = index % img.width();
 			const int y = index / img.width();
-			stream << (quint8)img.pixel(x, y);
+			*dst++ = (quint8)img.pixel(x, y);
 		}
-	}
+	});
+
+	stream.writeRawData(data.constData(), data.size());
 }
 
 
@@ -187,7 +204,7 @@ void writeUncompressed8BPPData(QDataStream& stream, const QVector<QImage>& index
 #define STORE_RIGHT	2	// Store the block in the right half of a 64D vector
 
 template<uint N>
-static void grab2x4Block(const QImage& img, const Palette& pal, const int x, const int y, Vec<N>& vec, const uint storeMethod) {
+static void grab2x4Block(const QImage& img, const Palette& pal, const int x, const int y, Vec<N>& vec, uint& hash, const uint storeMethod) {
 	static const int indexLUT[3][8] = {
 		{ 0,  4,  8, 12, 16, 20, 24, 28 }, // Full 32D vector
 		{ 0,  4, 16, 20, 32, 36, 48, 52 }, // Left half of 64D vector
@@ -195,7 +212,6 @@ static void grab2x4Block(const QImage& img, const Palette& pal, const int x, con
 	};
 
 	int index = 0;
-	uint hash = vec.hash();
 
 	for (int yy=y; yy<(y+4); yy++) {
 		for (int xx=x; xx<(x+2); xx++) {
@@ -205,8 +221,6 @@ static void grab2x4Block(const QImage& img, const Palette& pal, const int x, con
 			index++;
 		}
 	}
-
-	vec.setHash(hash);
 }
 
 static void vectorizePalette(const Palette& pal, QVector<Vec<4>>& vectors) {
@@ -230,9 +244,9 @@ static quint8 findClosest(const QVector<Vec<4>>& vectors, const Vec<4>& vec) {
 	return closestIndex;
 }
 
-void writeCompressed4BPPData(QDataStream& stream, const QVector<QImage>& indexedImages, const Palette& palette) {
-	VectorQuantizer<64> vq;
-	QVector<Vec<64>> vectors;
+int writeCompressed4BPPData(QDataStream& stream, const QVector<QImage>& indexedImages, const Palette& palette, const VQSettings& vqSettings) {
+	VectorQuantizer<64> vq(vqSettings);
+	VecStore<64> vectors;
 
 	// Vectorize the input images.
 	// Each vector represents a pair of 2x4 pixel blocks. For single images, it's
@@ -243,7 +257,8 @@ void writeCompressed4BPPData(QDataStream& stream, const QVector<QImage>& indexed
 	// half of the 4x4 pixel block at twiddledIndex[n+1]. This makes the mipmapped
 	// vectorization code a lot more complex.
 	if (indexedImages.size() > 1) {
-		Vec<64> vec(0);
+		Vec<64> vec;
+		uint hash = 0;
 
 		for (int i=0; i<indexedImages.size(); i++) {
 			const QImage& img = indexedImages[i];
@@ -255,7 +270,7 @@ void writeCompressed4BPPData(QDataStream& stream, const QVector<QImage>& indexed
 			const int imgw = img.width();
 			const int imgh = img.height();
 			const int blocks = (imgw * imgh) / 16;
-			const Twiddler twiddler(imgw / 4, imgh / 4);
+			const Twiddler& twiddler = Twiddler::shared(imgw / 4, imgh / 4);
 
 			for (int j=0; j<blocks; j++) {
 				const int twidx = twiddler.index(j);
@@ -267,28 +282,28 @@ void writeCompressed4BPPData(QDataStream& stream, const QVector<QImage>& indexed
 				// and potentially mess up the encoding by introducing colors that
 				// don't exist in the image, we copy the second half of the vector
 				// to the first half.
-				if (vectors.empty()) {
-					grab2x4Block(img, palette, x, y, vec, STORE_LEFT);
+				if (vectors.isEmpty()) {
+					grab2x4Block(img, palette, x, y, vec, hash, STORE_LEFT);
 				}
 
 				// First half of this block is the second half of the
 				// vector we're currently creating.
-				grab2x4Block(img, palette, x, y, vec, STORE_RIGHT);
+				grab2x4Block(img, palette, x, y, vec, hash, STORE_RIGHT);
 
 				// This vector is done now, so flush it and remember to
 				// clear the hash for the next vector.
-				vectors.push_back(vec);
-				vec.setHash(0);
+				vectors.push_back(vec, hash);
+				hash = 0;
 
 				// Second half of this block is the first half of the next
 				// vector we're creating.
-				grab2x4Block(img, palette, x + 2, y, vec, STORE_LEFT);
+				grab2x4Block(img, palette, x + 2, y, vec, hash, STORE_LEFT);
 
 				// If this is the last block of the last image, remember to
 				// fill the current vector with something good and flush it.
 				if ((i == (indexedImages.size() - 1)) && (j == (blocks - 1))) {
-					grab2x4Block(img, palette, x + 2, y, vec, STORE_RIGHT);
-					vectors.push_back(vec);
+					grab2x4Block(img, palette, x + 2, y, vec, hash, STORE_RIGHT);
+					vectors.push_back(vec, hash);
 				}
 			}
 		}
@@ -301,21 +316,32 @@ void writeCompressed4BPPData(QDataStream& stream, const QVector<QImage>& indexed
 		const int imgw = img.width();
 		const int imgh = img.height();
 		const int blocks = (imgw * imgh) / 16;
-		const Twiddler twiddler(imgw / 4, imgh / 4);
+		const Twiddler& twiddler = Twiddler::shared(imgw / 4, imgh / 4);
 
 		for (int j=0; j<blocks; j++) {
 			const int twidx = twiddler.index(j);
 			const int x = (twidx % (imgw / 4)) * 4;
 			const int y = (twidx / (imgw / 4)) * 4;
 
-			Vec<64> vec(0);
-			grab2x4Block(img, palette, x + 0, y, vec, STORE_LEFT);
-			grab2x4Block(img, palette, x + 2, y, vec, STORE_RIGHT);
-			vectors.push_back(vec);
+			Vec<64> vec;
+			uint hash = 0;
+			grab2x4Block(img, palette, x + 0, y, vec, hash, STORE_LEFT);
+			grab2x4Block(img, palette, x + 2, y, vec, hash, STORE_RIGHT);
+			vectors.push_back(vec, hash);
 		}
 	}
 
-	vq.compress(vectors, 256);
+	vq.compress(vectors, vqSettings.codes);
+
+	// Find out where every code goes in the stored codebook
+	QVector<int> indices;
+	vq.findClosest(vectors, indices);
+	QVector<bool> used(vq.codeCount(), !vqSettings.trimCodebook);
+	for (int i=0; i<indices.size(); i++)
+		used[indices[i]] = true;
+	QVector<int> codeSlots;
+	const int storedCodes = assignCodeSlots(used, vqSettings.trimCodebook, codeSlots);
+	const int firstSlot = VQ_CODES_MAX - storedCodes;
 
 	// The palette needs to be in a vector format for the next part,
 	// since we need to be able to perform searches in it.
@@ -325,9 +351,12 @@ void writeCompressed4BPPData(QDataStream& stream, const QVector<QImage>& indexed
 	// Build the codebook
 	quint8 codebook[2048];
 	memset(codebook, 0, 2048);
-	const Twiddler nibbleLUT(4, 4);
+	const Twiddler& nibbleLUT = Twiddler::shared(4, 4);
 	for (int i=0; i<vq.codeCount(); i++) {
+		if (codeSlots[i] < 0)
+			continue;
 		const Vec<64>& vec = vq.codeVector(i);
+		const int slot = codeSlots[i];
 
 		for (int j=0; j<16; j++) {
 			Vec<4> color;
@@ -343,14 +372,14 @@ void writeCompressed4BPPData(QDataStream& stream, const QVector<QImage>& indexed
 			const int nibble = j % 2;
 
 			if (nibble == 1)
-				codebook[i*8+byte] |= ((closestIndex & 0xF) << 4);
+				codebook[slot*8+byte] |= ((closestIndex & 0xF) << 4);
 			else
-				codebook[i*8+byte] |= (closestIndex & 0xF);
+				codebook[slot*8+byte] |= (closestIndex & 0xF);
 		}
 	}
 
 	// Write the codebook
-	stream.writeRawData((char*)codebook, 2048);
+	stream.writeRawData((char*)codebook + firstSlot * 8, storedCodes * 8);
 
 	// Don't write out a zero for the 1x1 mipmap like we would usually
 	// do for mipmapped VQ textures. The reason for this is that it's
@@ -360,18 +389,17 @@ void writeCompressed4BPPData(QDataStream& stream, const QVector<QImage>& indexed
 	//	writeZeroes(stream, 1);
 
 	// Write the index data
-	for (int i=0; i<vectors.size(); i++) {
-		const Vec<64>& srcvec = vectors.at(i);
-		const int c = vq.findClosest(srcvec);
-		stream << (quint8)c;
-	}
+	for (int i=0; i<indices.size(); i++)
+		stream << (quint8)codeSlots[indices[i]];
+
+	return storedCodes;
 }
 
 
 
-void writeCompressed8BPPData(QDataStream& stream, const QVector<QImage>& indexedImages, const Palette& palette) {
-	VectorQuantizer<32> vq;
-	QVector<Vec<32>> vectors;
+int writeCompressed8BPPData(QDataStream& stream, const QVector<QImage>& indexedImages, const Palette& palette, const VQSettings& vqSettings) {
+	VectorQuantizer<32> vq(vqSettings);
+	VecStore<32> vectors;
 
 	// Vectorize the input images.
 	// Each vector represents a 2x4 pixel block.
@@ -387,7 +415,7 @@ void writeCompressed8BPPData(QDataStream& stream, const QVector<QImage>& indexed
 		const int imgw = img.width();
 		const int imgh = img.height();
 		const int blocks = (imgw * imgh) / 16;
-		const Twiddler twiddler(imgw / 4, imgh / 4);
+		const Twiddler& twiddler = Twiddler::shared(imgw / 4, imgh / 4);
 
 		for (int j=0; j<blocks; j++) {
 			const int twidx = twiddler.index(j);
@@ -395,15 +423,27 @@ void writeCompressed8BPPData(QDataStream& stream, const QVector<QImage>& indexed
 			const int y = (twidx / (imgw / 4)) * 4;
 			Vec<32> vec;
 
-			grab2x4Block(img, palette, x + 0, y, vec, STORE_FULL);
-			vectors.push_back(vec);
+			uint hash = 0;
+			grab2x4Block(img, palette, x + 0, y, vec, hash, STORE_FULL);
+			vectors.push_back(vec, hash);
 
-			grab2x4Block(img, palette, x + 2, y, vec, STORE_FULL);
-			vectors.push_back(vec);
+			hash = 0;
+			grab2x4Block(img, palette, x + 2, y, vec, hash, STORE_FULL);
+			vectors.push_back(vec, hash);
 		}
 	}
 
-	vq.compress(vectors, 256);
+	vq.compress(vectors, vqSettings.codes);
+
+	// Find out where every code goes in the stored codebook
+	QVector<int> indices;
+	vq.findClosest(vectors, indices);
+	QVector<bool> used(vq.codeCount(), !vqSettings.trimCodebook);
+	for (int i=0; i<indices.size(); i++)
+		used[indices[i]] = true;
+	QVector<int> codeSlots;
+	const int storedCodes = assignCodeSlots(used, vqSettings.trimCodebook, codeSlots);
+	const int firstSlot = VQ_CODES_MAX - storedCodes;
 
 	// The palette needs to be in a vector format for the next part,
 	// since we need to be able to perform searches in it.
@@ -413,8 +453,10 @@ void writeCompressed8BPPData(QDataStream& stream, const QVector<QImage>& indexed
 	// Build the codebook
 	quint8 codebook[2048];
 	memset(codebook, 0, 2048);
-	const Twiddler nibbleLUT(2, 4);
+	const Twiddler& nibbleLUT = Twiddler::shared(2, 4);
 	for (int i=0; i<vq.codeCount(); i++) {
+		if (codeSlots[i] < 0)
+			continue;
 		const Vec<32>& vec = vq.codeVector(i);
 
 		for (int j=0; j<8; j++) {
@@ -425,21 +467,20 @@ void writeCompressed8BPPData(QDataStream& stream, const QVector<QImage>& indexed
 			color.set(3, vec[nibbleLUT.index(j) * 4 + 3]);
 
 			// Search the palette for the closest index
-			codebook[i * 8 + j] = findClosest(vectorizedPalette, color);
+			codebook[codeSlots[i] * 8 + j] = findClosest(vectorizedPalette, color);
 		}
 	}
 
 	// Write the codebook
-	stream.writeRawData((char*)codebook, 2048);
+	stream.writeRawData((char*)codebook + firstSlot * 8, storedCodes * 8);
 
 	// Write the 1x1 mipmap level
 	if (indexedImages.size() > 1)
 		writeZeroes(stream, 1);
 
 	// Write the index data
-	for (int i=0; i<vectors.size(); i++) {
-		const Vec<32>& srcvec = vectors.at(i);
-		const int c = vq.findClosest(srcvec);
-		stream << (quint8)c;
-	}
+	for (int i=0; i<indices.size(); i++)
+		stream << (quint8)codeSlots[indices[i]];
+
+	return storedCodes;
 }
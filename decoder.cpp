@@ -0,0 +1,441 @@
+#include <QDebug>
+#include <QImage>
+#include <QtEndian>
+#include "common.h"
+#include "twiddler.h"
+#include "palette.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define DECODER_USE_SSE2
+#endif
+
+// A more or less evenly distributed 256-color palette for visualizing compression code
+// usage.
+static const QRgb codeColors[256] = {
+	0xffffffff, 0xffe3aaaa, 0xffffc7c7, 0xffaac7c7, 0xffaac7aa, 0xffaaaae3, 0xffaaaaff, 0xffaae3ff,
+	0xffffaae3, 0xffe3ffaa, 0xffffffaa, 0xffffaaff, 0xffaaffc7, 0xffe3c7ff, 0xffc7aaaa, 0xffe3e3e3,
+	0xffaa7171, 0xffc78e8e, 0xff718e8e, 0xff718e71, 0xff7171aa, 0xff7171c7, 0xff71aac7, 0xffc771aa,
+	0xffaac771, 0xffc7c771, 0xffc771c7, 0xff71c78e, 0xffaa8ec7, 0xff8e7171, 0xffaaaaaa, 0xffc7c7c7,
+	0xff710000, 0xff8e1c1c, 0xff381c1c, 0xff381c00, 0xff380038, 0xff380055, 0xff383855, 0xff8e0038,
+	0xff715500, 0xff8e5500, 0xff8e0055, 0xff38551c, 0xff711c55, 0xff550000, 0xff713838, 0xff8e5555,
+	0xffaa38aa, 0xffc755c7, 0xff7155c7, 0xff7155aa, 0xff7138e3, 0xff7138ff, 0xff7171ff, 0xffc738e3,
+	0xffaa8eaa, 0xffc78eaa, 0xffc738ff, 0xff718ec7, 0xffaa55ff, 0xff8e38aa, 0xffaa71e3, 0xffc78eff,
+	0xff38aa38, 0xff55c755, 0xff00c755, 0xff00c738, 0xff00aa71, 0xff00aa8e, 0xff00e38e, 0xff55aa71,
+	0xff38ff38, 0xff55ff38, 0xff55aa8e, 0xff00ff55, 0xff38c78e, 0xff1caa38, 0xff38e371, 0xff55ff8e,
+	0xffe300aa, 0xffff1cc7, 0xffaa1cc7, 0xffaa1caa, 0xffaa00e3, 0xffaa00ff, 0xffaa38ff, 0xffff00e3,
+	0xffe355aa, 0xffff55aa, 0xffff00ff, 0xffaa55c7, 0xffe31cff, 0xffc700aa, 0xffe338e3, 0xffff55ff,
+	0xffe3aa00, 0xffffc71c, 0xffaac71c, 0xffaac700, 0xffaaaa38, 0xffaaaa55, 0xffaae355, 0xffffaa38,
+	0xffe3ff00, 0xffffff00, 0xffffaa55, 0xffaaff1c, 0xffe3c755, 0xffc7aa00, 0xffe3e338, 0xffffff55,
+	0xffaaaa00, 0xffc7c71c, 0xff71c71c, 0xff71c700, 0xff71aa38, 0xff71aa55, 0xff71e355, 0xffc7aa38,
+	0xffaaff00, 0xffc7ff00, 0xffc7aa55, 0xff71ff1c, 0xffaac755, 0xff8eaa00, 0xffaae338, 0xffc7ff55,
+	0xffe30071, 0xffff1c8e, 0xffaa1c8e, 0xffaa1c71, 0xffaa00aa, 0xffaa00c7, 0xffaa38c7, 0xffff00aa,
+	0xffe35571, 0xffff5571, 0xffff00c7, 0xffaa558e, 0xffe31cc7, 0xffc70071, 0xffe338aa, 0xffff55c7,
+	0xff3871aa, 0xff558ec7, 0xff008ec7, 0xff008eaa, 0xff0071e3, 0xff0071ff, 0xff00aaff, 0xff5571e3,
+	0xff38c7aa, 0xff55c7aa, 0xff5571ff, 0xff00c7c7, 0xff388eff, 0xff1c71aa, 0xff38aae3, 0xff55c7ff,
+	0xff3800aa, 0xff551cc7, 0xff001cc7, 0xff001caa, 0xff0000e3, 0xff0000ff, 0xff0038ff, 0xff5500e3,
+	0xff3855aa, 0xff5555aa, 0xff5500ff, 0xff0055c7, 0xff381cff, 0xff1c00aa, 0xff3838e3, 0xff5555ff,
+	0xff380071, 0xff551c8e, 0xff001c8e, 0xff001c71, 0xff0000aa, 0xff0000c7, 0xff0038c7, 0xff5500aa,
+	0xff385571, 0xff555571, 0xff5500c7, 0xff00558e, 0xff381cc7, 0xff1c0071, 0xff3838aa, 0xff5555c7,
+	0xff383800, 0xff55551c, 0xff00551c, 0xff005500, 0xff003838, 0xff003855, 0xff007155, 0xff553838,
+	0xff388e00, 0xff558e00, 0xff553855, 0xff008e1c, 0xff385555, 0xff1c3800, 0xff387138, 0xff558e55,
+	0xff383838, 0xff555555, 0xff005555, 0xff005538, 0xff003871, 0xff00388e, 0xff00718e, 0xff553871,
+	0xff388e38, 0xff558e38, 0xff55388e, 0xff008e55, 0xff38558e, 0xff1c3838, 0xff387171, 0xff558e8e,
+	0xffe33838, 0xffff5555, 0xffaa5555, 0xffaa5538, 0xffaa3871, 0xffaa388e, 0xffaa718e, 0xffff3871,
+	0xffe38e38, 0xffff8e38, 0xffff388e, 0xffaa8e55, 0xffe3558e, 0xffc73838, 0xffe37171, 0xffff8e8e,
+	0xffaa0000, 0xffc71c1c, 0xff711c1c, 0xff711c00, 0xff710038, 0xff710055, 0xff713855, 0xffc70038,
+	0xffaa5500, 0xffc75500, 0xffc70055, 0xff71551c, 0xffaa1c55, 0xff8e0000, 0xffaa3838, 0xffc75555
+};
+
+
+// Where the texels of a code go in its block. Codes are stored column by
+// column, two texels wide, just like twiddled textures.
+static const int codeLayout[8][2] = {
+	{ 0, 0 }, { 0, 1 }, { 1, 0 }, { 1, 1 }, { 0, 2 }, { 0, 3 }, { 1, 2 }, { 1, 3 }
+};
+
+// ARGB32 values for all 65536 texels of a 16-bit format, except YUV422,
+// where a texel doesn't have a color of its own.
+static QVector<QRgb> buildTexelTable(int pixelFormat) {
+	QVector<QRgb> table(65536);
+	for (int i=0; i<table.size(); i++)
+		table[i] = to32BPP(i, pixelFormat);
+	return table;
+}
+
+// The tables are built the first time they're needed, and then kept
+static const QRgb* texelTable(int pixelFormat) {
+	switch (pixelFormat) {
+	case PIXELFORMAT_ARGB1555: {
+		static const QVector<QRgb> table = buildTexelTable(PIXELFORMAT_ARGB1555);
+		return table.constData();
+	}
+	case PIXELFORMAT_RGB565: {
+		static const QVector<QRgb> table = buildTexelTable(PIXELFORMAT_RGB565);
+		return table.constData();
+	}
+	case PIXELFORMAT_ARGB4444: {
+		static const QVector<QRgb> table = buildTexelTable(PIXELFORMAT_ARGB4444);
+		return table.constData();
+	}
+	case PIXELFORMAT_BUMPMAP: {
+		static const QVector<QRgb> table = buildTexelTable(PIXELFORMAT_BUMPMAP);
+		return table.constData();
+	}
+	default:
+		return NULL;
+	}
+}
+
+// Decodes 'count' YUV422 texels, stored as pairs of (Y0 U, Y1 V). This is
+// YUV422toRGB(), with the math in fixed point. The factors are all in 1/32
+// steps, so the results are exactly the same.
+static void decodeYUV(const uchar* src, QRgb* dst, int count) {
+	int i = 0;
+#ifdef DECODER_USE_SSE2
+	const __m128i lowByte = _mm_set1_epi32(0xff);
+	const __m128i bias = _mm_set1_epi16(128);
+	const __m128i alpha = _mm_set1_epi8((char)0xff);
+	for (; i+8<=count; i+=8) {
+		const __m128i texels = _mm_loadu_si128((const __m128i*)(src + i * 2));
+
+		// Spread U and V out to both texels of their pair
+		const __m128i u = _mm_and_si128(texels, lowByte);
+		const __m128i v = _mm_and_si128(_mm_srli_epi32(texels, 16), lowByte);
+		const __m128i U = _mm_sub_epi16(_mm_or_si128(u, _mm_slli_epi32(u, 16)), bias);
+		const __m128i V = _mm_sub_epi16(_mm_or_si128(v, _mm_slli_epi32(v, 16)), bias);
+		const __m128i Y = _mm_slli_epi16(_mm_srli_epi16(texels, 8), 5);
+
+		const __m128i r = _mm_srai_epi16(_mm_add_epi16(Y, _mm_mullo_epi16(V, _mm_set1_epi16(44))), 5);
+		const __m128i g = _mm_srai_epi16(_mm_sub_epi16(Y, _mm_add_epi16(_mm_mullo_epi16(U, _mm_set1_epi16(11)), _mm_mullo_epi16(V, _mm_set1_epi16(22)))), 5);
+		const __m128i b = _mm_srai_epi16(_mm_add_epi16(Y, _mm_mullo_epi16(U, _mm_set1_epi16(55))), 5);
+
+		// Clamp to 0-255 and interleave into BGRA bytes
+		const __m128i r8 = _mm_packus_epi16(r, r);
+		const __m128i g8 = _mm_packus_epi16(g, g);
+		const __m128i b8 = _mm_packus_epi16(b, b);
+		const __m128i bg = _mm_unpacklo_epi8(b8, g8);
+		const __m128i ra = _mm_unpacklo_epi8(r8, alpha);
+		_mm_storeu_si128((__m128i*)(dst + i + 0), _mm_unpacklo_epi16(bg, ra));
+		_mm_storeu_si128((__m128i*)(dst + i + 4), _mm_unpackhi_epi16(bg, ra));
+	}
+#endif
+	for (; i+2<=count; i+=2) {
+		const quint16 yuv0 = qFromLittleEndian<quint16>(src + i * 2 + 0);
+		const quint16 yuv1 = qFromLittleEndian<quint16>(src + i * 2 + 2);
+		YUV422toRGB(yuv0, yuv1, dst[i + 0], dst[i + 1]);
+	}
+}
+
+// Decodes one uncompressed 16-bit level, in twiddled or scan order
+static void decode16BPP(const uchar* src, int pixelFormat, bool twiddled, QRgb* dst, int width, int height) {
+	const int pixels = width * height;
+
+	if (pixelFormat == PIXELFORMAT_YUV422) {
+		if (!twiddled) {
+			decodeYUV(src, dst, pixels);
+			return;
+		}
+
+		// The pairs are texels 0 and 2, and 1 and 3, of each 2x2 block.
+		// Put them next to each other, decode, and put the colors back.
+		QVector<uchar> pairs(pixels * 2);
+		for (int i=0; i<pixels; i+=4) {
+			memcpy(&pairs[(i + 0) * 2], src + (i + 0) * 2, 2);
+			memcpy(&pairs[(i + 1) * 2], src + (i + 2) * 2, 2);
+			memcpy(&pairs[(i + 2) * 2], src + (i + 1) * 2, 2);
+			memcpy(&pairs[(i + 3) * 2], src + (i + 3) * 2, 2);
+		}
+		QVector<QRgb> colors(pixels);
+		decodeYUV(pairs.constData(), colors.data(), pixels);
+
+		const Twiddler& twiddler = Twiddler::shared(width, height);
+		for (int i=0; i<pixels; i+=4) {
+			dst[twiddler.index(i + 0)] = colors[i + 0];
+			dst[twiddler.index(i + 2)] = colors[i + 1];
+			dst[twiddler.index(i + 1)] = colors[i + 2];
+			dst[twiddler.index(i + 3)] = colors[i + 3];
+		}
+		return;
+	}
+
+	const QRgb* table = texelTable(pixelFormat);
+	if (!twiddled) {
+		for (int i=0; i<pixels; i++)
+			dst[i] = table[qFromLittleEndian<quint16>(src + i * 2)];
+	} else {
+		const Twiddler& twiddler = Twiddler::shared(width, height);
+		for (int i=0; i<pixels; i++)
+			dst[twiddler.index(i)] = table[qFromLittleEndian<quint16>(src + i * 2)];
+	}
+}
+
+// The colors of all 256 codes in a codebook, in the order they're stored
+static QVector<QRgb> decodeCodebook(const uchar* codebook, int textureType, const QRgb* colors) {
+	const int pixelFormat = (textureType >> PIXELFORMAT_SHIFT) & PIXELFORMAT_MASK;
+	QVector<QRgb> codes;
+
+	if (pixelFormat == PIXELFORMAT_PAL4BPP) {
+		codes.resize(VQ_CODES_MAX * 16);
+		for (int i=0; i<codes.size(); i+=2) {
+			codes[i + 0] = colors[(codebook[i / 2] >> 0) & 0xf];
+			codes[i + 1] = colors[(codebook[i / 2] >> 4) & 0xf];
+		}
+	} else if (pixelFormat == PIXELFORMAT_PAL8BPP) {
+		codes.resize(VQ_CODES_MAX * 8);
+		for (int i=0; i<codes.size(); i++)
+			codes[i] = colors[codebook[i]];
+	} else {
+		// Twiddled 2x2 blocks, just like a 16-bit level. The texels are
+		// kept in the order they're stored in.
+		const Twiddler& twiddler = Twiddler::shared(2, 2);
+		codes.resize(VQ_CODES_MAX * 4);
+		for (int i=0; i<VQ_CODES_MAX; i++) {
+			QRgb block[4];
+			decode16BPP(codebook + i * 8, pixelFormat, true, block, 2, 2);
+			for (int j=0; j<4; j++)
+				codes[i * 4 + j] = block[twiddler.index(j)];
+		}
+	}
+
+	return codes;
+}
+
+// Copies 'count' texels of a code into a block of 'img', starting at (x, y)
+static void drawCode(QRgb* img, int stride, int x, int y, const QRgb* texels, int count) {
+	for (int i=0; i<count; i++)
+		img[(y + codeLayout[i][1]) * stride + (x + codeLayout[i][0])] = texels[i];
+}
+
+// Fills a block of 'img' with the color of a code
+static void drawBlock(QRgb* img, int stride, int x, int y, int w, int h, int codebookIndex) {
+	const QRgb color = codeColors[codebookIndex];
+	for (int yy=y; yy<(y+h); yy++)
+		for (int xx=x; xx<(x+w); xx++)
+			img[yy * stride + xx] = color;
+}
+
+bool readTextureHeader(const QByteArray& texture, TextureHeader& header) {
+	if (texture.size() < 16 || memcmp(texture.constData(), TEXTURE_MAGIC, 4) != 0)
+		return false;
+
+	const uchar* data = (const uchar*)texture.constData();
+	header.width = qFromLittleEndian<qint16>(data + 4);
+	header.height = qFromLittleEndian<qint16>(data + 6);
+	header.textureType = qFromLittleEndian<qint32>(data + 8);
+	header.size = qFromLittleEndian<qint32>(data + 12);
+
+	// Texture width for stride textures are stored in the stride setting, not in
+	// the width field. So unpack that if neccessary.
+	if (header.textureType & FLAG_STRIDED)
+		header.width = (header.textureType & 31) * 32;
+
+	const int pixelFormat = (header.textureType >> PIXELFORMAT_SHIFT) & PIXELFORMAT_MASK;
+	if (pixelFormat > PIXELFORMAT_PAL8BPP || !isValidSize(header.width, header.height, header.textureType))
+		return false;
+	if ((header.textureType & FLAG_MIPMAPPED) && header.width != header.height)
+		return false;
+
+	// Refuse the same stride textures checkStride() does. The width of a
+	// stride texture doesn't have to be a power of two, so it can't be
+	// twiddled, compressed or mipmapped.
+	if ((header.textureType & FLAG_STRIDED) && ((header.textureType & (FLAG_COMPRESSED | FLAG_MIPMAPPED)) || !(header.textureType & FLAG_NONTWIDDLED)
+		|| isPaletted(header.textureType) || isFormat(header.textureType, PIXELFORMAT_BUMPMAP)))
+		return false;
+	return header.size >= calculateSize(header.width, header.height, header.textureType) && header.size <= VRAM_SIZE;
+}
+
+bool decodeTexture(const QByteArray& texture, const Palette& palette, QVector<QImage>* decoded, QVector<QImage>* codeUsage) {
+	const bool genPreview = (decoded != NULL);
+	const bool genCodeUsage = (codeUsage != NULL);
+
+	if (!genPreview && !genCodeUsage) {
+		qCritical() << "decodeTexture requires either decoded images or code usage images";
+		return false;
+	}
+
+	// Read and verify the header
+	TextureHeader header;
+	if (!readTextureHeader(texture, header) || header.size > texture.size() - 16) {
+		qCritical() << "Not a valid texture";
+		return false;
+	}
+	const int width = header.width;
+	const int height = header.height;
+	const int textureType = header.textureType;
+	const int pixelFormat = (textureType >> PIXELFORMAT_SHIFT) & PIXELFORMAT_MASK;
+	const bool compressed = (textureType & FLAG_COMPRESSED);
+	const bool mipmapped = (textureType & FLAG_MIPMAPPED);
+
+	if (!genPreview && !compressed) {
+		qCritical() << "decodeTexture was told to only generate code usage, but texture is not compressed";
+		return false;
+	}
+
+	if (isPaletted(textureType) && palette.colorCount() == 0)
+		return false;
+
+	// The palette is a hash from colors to indices, so look the colors up
+	// in a table instead.
+	const QVector<QRgb> colorTable = palette.colorTable();
+	const QRgb* colors = colorTable.constData();
+
+	// A trimmed codebook is missing its first codes, so the data is read in
+	// after that many zeroed codes, like the texture address in VRAM would
+	// point before the start of the codebook. The rest of the decoding can
+	// then assume a full codebook. Anything after the size the type needs
+	// isn't used, so it's left out.
+	const int dataSize = calculateSize(width, height, textureType);
+	const int missingCodeBytes = compressed ? (VQ_CODES_MAX - codebookSize(textureType)) * 8 : 0;
+	QByteArray buffer(missingCodeBytes + dataSize, 0);
+	memcpy(buffer.data() + missingCodeBytes, texture.constData() + 16, dataSize);
+	const uchar* data = (const uchar*)buffer.constData();
+
+	QVector<QImage> decodedImages;
+	QVector<QImage> codeUsageImages;
+
+	if (!compressed) {
+		// Levels are stored from smallest to largest. Stride and other
+		// non-twiddled textures are in scan order.
+		const bool twiddled = !(textureType & FLAG_NONTWIDDLED);
+		int levelWidth = width;
+		int levelHeight = height;
+		int offset = 0;
+
+		if (mipmapped) {
+			levelWidth = 1;
+			levelHeight = 1;
+			offset = is16BPP(textureType) ? MIPMAP_OFFSET_16BPP : isFormat(textureType, PIXELFORMAT_PAL4BPP) ? MIPMAP_OFFSET_4BPP : MIPMAP_OFFSET_8BPP;
+		}
+
+		while (levelWidth <= width && levelHeight <= height) {
+			QImage img(levelWidth, levelHeight, QImage::Format_ARGB32);
+			QRgb* dst = (QRgb*)img.bits();
+			const int pixels = levelWidth * levelHeight;
+
+			if (pixelFormat == PIXELFORMAT_PAL4BPP) {
+				if (pixels == 1) {
+					dst[0] = colors[data[offset] & 0xf];
+					offset++;
+				} else {
+					const Twiddler& twiddler = Twiddler::shared(levelWidth, levelHeight);
+					for (int i=0; i<pixels; i+=2) {
+						dst[twiddler.index(i + 0)] = colors[(data[offset + i / 2] >> 0) & 0xf];
+						dst[twiddler.index(i + 1)] = colors[(data[offset + i / 2] >> 4) & 0xf];
+					}
+					offset += pixels / 2;
+				}
+			} else if (pixelFormat == PIXELFORMAT_PAL8BPP) {
+				const Twiddler& twiddler = Twiddler::shared(levelWidth, levelHeight);
+				for (int i=0; i<pixels; i++)
+					dst[twiddler.index(i)] = colors[data[offset + i]];
+				offset += pixels;
+			} else {
+				// The 1x1 mipmap level for YUV textures is stored as RGB565
+				const bool rgb = (pixelFormat == PIXELFORMAT_YUV422 && pixels == 1);
+				decode16BPP(data + offset, rgb ? PIXELFORMAT_RGB565 : pixelFormat, twiddled, dst, levelWidth, levelHeight);
+				offset += pixels * 2;
+			}
+
+			decodedImages.push_front(img);
+			levelWidth *= 2;
+			levelHeight *= 2;
+		}
+	} else {
+		// Each byte after the codebook is a code for a 2x2 block in 16-bit
+		// textures, half a 4x4 block in 8-bit ones and a 4x4 block in 4-bit
+		// ones. The blocks are twiddled.
+		const QVector<QRgb> codes = genPreview ? decodeCodebook(data, textureType, colors) : QVector<QRgb>();
+		const int blockSize = is16BPP(textureType) ? 2 : 4;
+		int levelWidth = width;
+		int levelHeight = height;
+		int offset = VQ_CODES_MAX * 8;
+
+		if (mipmapped) {
+			levelWidth = blockSize;
+			levelHeight = blockSize;
+			offset += 1;
+		}
+
+		while (levelWidth <= width && levelHeight <= height) {
+			QImage img;
+			QImage cui;
+			QRgb* dst = NULL;
+			QRgb* usage = NULL;
+			if (genPreview) {
+				img = QImage(levelWidth, levelHeight, QImage::Format_ARGB32);
+				dst = (QRgb*)img.bits();
+			}
+			if (genCodeUsage) {
+				cui = QImage(levelWidth, levelHeight, QImage::Format_ARGB32);
+				usage = (QRgb*)cui.bits();
+			}
+			const Twiddler& twiddler = Twiddler::shared(levelWidth / blockSize, levelHeight / blockSize);
+			const int blocks = (levelWidth / blockSize) * (levelHeight / blockSize);
+
+			for (int i=0; i<blocks; i++) {
+				const int twidx = twiddler.index(i);
+				const int x = (twidx % (levelWidth / blockSize)) * blockSize;
+				const int y = (twidx / (levelWidth / blockSize)) * blockSize;
+
+				if (is16BPP(textureType)) {
+					const int code = data[offset + i];
+					if (dst)
+						drawCode(dst, levelWidth, x, y, codes.constData() + code * 4, 4);
+					if (usage)
+						drawBlock(usage, levelWidth, x, y, 2, 2, code);
+				} else if (pixelFormat == PIXELFORMAT_PAL8BPP) {
+					// Two codes side by side
+					const int code0 = data[offset + i * 2 + 0];
+					const int code1 = data[offset + i * 2 + 1];
+					if (dst) {
+						drawCode(dst, levelWidth, x + 0, y, codes.constData() + code0 * 8, 8);
+						drawCode(dst, levelWidth, x + 2, y, codes.constData() + code1 * 8, 8);
+					}
+					if (usage) {
+						drawBlock(usage, levelWidth, x + 0, y, 2, 4, code0);
+						drawBlock(usage, levelWidth, x + 2, y, 2, 4, code1);
+					}
+				} else if (!mipmapped) {
+					const int code = data[offset + i];
+					if (dst) {
+						drawCode(dst, levelWidth, x + 0, y, codes.constData() + code * 16 + 0, 8);
+						drawCode(dst, levelWidth, x + 2, y, codes.constData() + code * 16 + 8, 8);
+					}
+					if (usage)
+						drawBlock(usage, levelWidth, x, y, 4, 4, code);
+				} else {
+					// Mipmapped 4-bit textures are off by half a code. Each
+					// block is the second half of one code and the first
+					// half of the next.
+					const int code0 = data[offset + i - 1];
+					const int code1 = data[offset + i - 0];
+					if (dst) {
+						drawCode(dst, levelWidth, x + 0, y, codes.constData() + code0 * 16 + 8, 8);
+						drawCode(dst, levelWidth, x + 2, y, codes.constData() + code1 * 16 + 0, 8);
+					}
+					if (usage) {
+						drawBlock(usage, levelWidth, x + 0, y, 2, 4, code0);
+						drawBlock(usage, levelWidth, x + 2, y, 2, 4, code1);
+					}
+				}
+			}
+
+			if (genPreview)
+				decodedImages.push_front(img);
+			if (genCodeUsage)
+				codeUsageImages.push_front(cui);
+
+			offset += blocks * (isFormat(textureType, PIXELFORMAT_PAL8BPP) ? 2 : 1);
+			levelWidth *= 2;
+			levelHeight *= 2;
+		}
+	}
+
+	if (genPreview)
+		*decoded = decodedImages;
+	if (genCodeUsage)
+		*codeUsage = codeUsageImages;
+
+	return true;
+}
@@ -19,22 +19,54 @@ bool ImageContainer::load(const QStringList& filenames, const int textureType, c
 			return false;
 		}
 
-		if (!isValidSize(img.width(), img.height(), textureType)) {
-			qCritical("Image %s has an invalid texture size %dx%d", qPrintable(filename), img.width(), img.height());
+		if (!insert(img, filename, textureType))
 			return false;
-		}
 
-		if (mipmapped && (img.width() != img.height())) {
-			qCritical() << "Image" << filename << "is not square. Input images for mipmapped textures must be square";
+		qDebug() << "Loaded image" << filename;
+	}
+
+	return finishLoading(textureType, mipmapFilter);
+}
+
+bool ImageContainer::load(const QVector<QImage>& sources, const QString& name, const int textureType, const Qt::TransformationMode mipmapFilter) {
+	if ((sources.size() > 1) && !(textureType & FLAG_MIPMAPPED)) {
+		qCritical() << "Only one input image may be given if no mipmap flag has been given.";
+		return false;
+	}
+
+	foreach (const QImage& img, sources) {
+		if (img.isNull()) {
+			qCritical() << "Failed to load image" << name;
 			return false;
 		}
+		if (!insert(img, name, textureType))
+			return false;
+	}
 
-		textureSize = textureSize.expandedTo(img.size());
-		images.insert(img.width(), img);
+	return finishLoading(textureType, mipmapFilter);
+}
 
-		qDebug() << "Loaded image" << filename;
+bool ImageContainer::insert(const QImage& img, const QString& name, const int textureType) {
+	const bool mipmapped	= (textureType & FLAG_MIPMAPPED);
+
+	if (!isValidSize(img.width(), img.height(), textureType)) {
+		qCritical("Image %s has an invalid texture size %dx%d", qPrintable(name), img.width(), img.height());
+		return false;
+	}
+
+	if (mipmapped && (img.width() != img.height())) {
+		qCritical() << "Image" << name << "is not square. Input images for mipmapped textures must be square";
+		return false;
 	}
 
+	textureSize = textureSize.expandedTo(img.size());
+	images.insert(img.width(), img);
+	return true;
+}
+
+bool ImageContainer::finishLoading(const int textureType, const Qt::TransformationMode mipmapFilter) {
+	const bool mipmapped	= (textureType & FLAG_MIPMAPPED);
+
 	if (mipmapped) {
 		if (mipmapFilter == Qt::FastTransformation) {
 			qDebug("Using nearest-neighbor filtering for mipmaps");
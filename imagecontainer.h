@@ -32,6 +32,12 @@ public:
 	 *   mipmap levels will be generated automatically.
 	 */
 	bool load(const QStringList& filenames, const int textureType, const Qt::TransformationMode mipmapFilter);
+
+	/**
+	 * Same as above, but for images that are already in memory. 'name' is
+	 * only used in messages.
+	 */
+	bool load(const QVector<QImage>& sources, const QString& name, const int textureType, const Qt::TransformationMode mipmapFilter);
 	void unloadAll();
 
 	bool hasMipmaps() const { return images.size() > 1; }
@@ -47,6 +53,9 @@ public:
 
 
 private:
+	bool insert(const QImage& img, const QString& name, const int textureType);
+	bool finishLoading(const int textureType, const Qt::TransformationMode mipmapFilter);
+
 	QSize				textureSize = QSize(0, 0);
 	QMap<int, QImage>	images;
 	QList<int>			keys;
@@ -0,0 +1,191 @@
+#include "common.h"
+#include "archive.h"
+
+#include <QByteArray>
+#include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QtConcurrent>
+#include <QtEndian>
+
+#include <algorithm>
+#include <cstring>
+
+// Size of a palette file header
+#define PALETTE_HEADER_SIZE	8
+
+// Checks the header 'data' of a palette that's 'size' bytes in all
+static void checkPalette(TextureInfo& info, const uchar* data, qint64 size) {
+	if (!data || size < PALETTE_HEADER_SIZE || memcmp(data, PALETTE_MAGIC, 4) != 0) {
+		info.error = "Invalid palette file";
+		return;
+	}
+	info.paletteColors = qFromLittleEndian<qint32>(data + 4);
+
+	const int maxColors = isFormat(info.header.textureType, PIXELFORMAT_PAL4BPP) ? 16 : 256;
+	if (info.paletteColors < 0 || info.paletteColors > maxColors)
+		info.error = QString("The palette has %1 colors, the format allows %2").arg(info.paletteColors).arg(maxColors);
+	else if (size < PALETTE_HEADER_SIZE + 4 * (qint64)info.paletteColors)
+		info.error = "The palette file is truncated";
+}
+
+// Checks the 16-byte header 'data' of a texture that's 'size' bytes in all.
+// Returns false if it's no good.
+static bool checkTexture(TextureInfo& info, const uchar* data, qint64 size) {
+	info.fileSize = size;
+
+	// readTextureHeader() only needs the header, so don't read the rest
+	const QByteArray header = QByteArray::fromRawData((const char*)data, 16);
+	if (memcmp(data, TEXTURE_MAGIC, 4) != 0) {
+		info.error = "Not a texture";
+		return false;
+	}
+	if (!readTextureHeader(header, info.header)) {
+		info.error = "Invalid header";
+		return false;
+	}
+
+	const int expectedSize = calculateSize(info.header.width, info.header.height, info.header.textureType);
+	if (info.header.size != expectedSize) {
+		info.error = QString("The header size is %1, the format needs %2").arg(info.header.size).arg(expectedSize);
+		return false;
+	}
+	if (size != 16 + (qint64)info.header.size) {
+		info.error = QString("The file is %1 bytes, the header says %2").arg(size).arg(16 + info.header.size);
+		return false;
+	}
+	return true;
+}
+
+// Returns true if the file is an archive, which is left for later
+static bool inspectFile(TextureInfo& info) {
+	QFile file(info.filename);
+	if (!file.open(QIODevice::ReadOnly)) {
+		info.error = "Failed to open";
+		return false;
+	}
+	const uchar* data = (file.size() >= 16) ? file.map(0, qMin(file.size(), (qint64)LZTEXTURE_HEADER_SIZE + 16)) : NULL;
+	if (!data) {
+		// An empty archive is smaller than a texture header
+		char magic[4];
+		if (file.read(magic, 4) == 4 && memcmp(magic, ARCHIVE_MAGIC, 4) == 0)
+			return true;
+		info.error = "Too small to be a texture";
+		return false;
+	}
+	if (memcmp(data, ARCHIVE_MAGIC, 4) == 0)
+		return true;
+
+	if (memcmp(data, LZTEXTURE_MAGIC, 4) == 0) {
+		// The data is compressed, so only the size of that can be checked
+		// without decompressing it
+		info.lz = true;
+		if (file.size() < LZTEXTURE_HEADER_SIZE + 16) {
+			info.error = "Too small to be an LZ texture";
+			return false;
+		}
+		const qint64 compressedSize = qFromLittleEndian<qint32>(data + 4);
+		const qint64 textureSize = 16 + (qint64)qFromLittleEndian<qint32>(data + LZTEXTURE_HEADER_SIZE + 12);
+		if (!checkTexture(info, data + LZTEXTURE_HEADER_SIZE, textureSize))
+			return false;
+		info.fileSize = file.size();
+		if (info.fileSize != LZTEXTURE_HEADER_SIZE + 16 + compressedSize) {
+			info.error = QString("The file is %1 bytes, the header says %2").arg(info.fileSize).arg(LZTEXTURE_HEADER_SIZE + 16 + compressedSize);
+			return false;
+		}
+	} else if (!checkTexture(info, data, file.size())) {
+		return false;
+	}
+	if (!isPaletted(info.header.textureType))
+		return false;
+
+	QFile paletteFile(info.filename + ".pal");
+	if (!paletteFile.open(QIODevice::ReadOnly))
+		info.error = "No palette file";
+	else if (paletteFile.size() < PALETTE_HEADER_SIZE)
+		info.error = "Invalid palette file";
+	else
+		checkPalette(info, paletteFile.map(0, PALETTE_HEADER_SIZE), paletteFile.size());
+	return false;
+}
+
+static void clearInfo(TextureInfo& info) {
+	info.fileSize = 0;
+	info.lz = false;
+	memset(&info.header, 0, sizeof(info.header));
+	info.paletteColors = -1;
+	info.error.clear();
+}
+
+// The archive is already open, so this is quick enough to do one at a time
+static void inspectArchive(const QString& filename, QVector<TextureInfo>& infos) {
+	TextureArchive archive;
+	if (!archive.open(filename)) {
+		TextureInfo info;
+		info.filename = filename;
+		clearInfo(info);
+		info.error = "Invalid archive";
+		infos.push_back(info);
+		return;
+	}
+
+	for (int i=0; i<archive.entryCount(); i++) {
+		const ArchiveEntry& entry = archive.entry(i);
+		TextureInfo info;
+		info.archive = filename;
+		info.filename = entry.name;
+		clearInfo(info);
+		if (checkTexture(info, (const uchar*)entry.texture.constData(), entry.texture.size()) && isPaletted(info.header.textureType)) {
+			if (entry.palette.isEmpty())
+				info.error = "No palette";
+			else
+				checkPalette(info, (const uchar*)entry.palette.constData(), entry.palette.size());
+		}
+		infos.push_back(info);
+	}
+}
+
+void findTextures(const QStringList& paths, QStringList& filenames, QStringList& names) {
+	// Directories are searched for texture files, other paths are taken as
+	// they are
+	foreach (const QString& path, paths) {
+		if (!QFileInfo(path).isDir()) {
+			filenames << path;
+			names << QFileInfo(path).fileName();
+			continue;
+		}
+		QStringList found;
+		QDirIterator it(path, QStringList() << "*.tex", QDir::Files, QDirIterator::Subdirectories);
+		while (it.hasNext())
+			found << it.next();
+		std::sort(found.begin(), found.end());
+		filenames << found;
+		foreach (const QString& filename, found)
+			names << QDir(path).relativeFilePath(filename);
+	}
+}
+
+void inspectTextures(const QStringList& filenames, QVector<TextureInfo>& infos) {
+	QVector<TextureInfo> files(filenames.size());
+	for (int i=0; i<filenames.size(); i++) {
+		files[i].filename = filenames[i];
+		clearInfo(files[i]);
+	}
+
+	// Opening the files is most of the work, so do lots of them at once
+	QVector<bool> archives(files.size());
+	TextureInfo* first = files.data();
+	QtConcurrent::blockingMap(files, [first, &archives](TextureInfo& info) {
+		archives[&info - first] = inspectFile(info);
+	});
+
+	// Archives are replaced by the textures in them
+	infos.clear();
+	for (int i=0; i<files.size(); i++) {
+		if (archives[i])
+			inspectArchive(files[i].filename, infos);
+		else
+			infos.push_back(files[i]);
+	}
+}
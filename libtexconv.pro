@@ -0,0 +1,8 @@
+# libtexconv, the converter as a static library. Include texconv.h, see
+# encode() there.
+
+TEMPLATE = lib
+CONFIG += staticlib
+TARGET = texconv
+
+include(texconv.pri)
@@ -0,0 +1,200 @@
+#include "common.h"
+
+#include <QByteArray>
+#include <QVector>
+#include <QtEndian>
+
+#include <cstring>
+
+// The compressed data is an LZ4 block. Every sequence is a token with the
+// literal length in the high nibble and the match length minus 4 in the low
+// one, extra length bytes when a nibble is 15, the literals, a 16-bit match
+// offset and extra match length bytes. The last sequence is literals only.
+#define LZ_MIN_MATCH		4
+#define LZ_MAX_OFFSET		65535
+#define LZ_LAST_LITERALS	5	// The data always ends with this many literals
+#define LZ_MATCH_LIMIT		12	// and the last match starts at least this far from the end
+
+// The compressor finds matches through chains of earlier positions with
+// the same hash. Longer chains compress better, but slower.
+#define LZ_HASH_BITS		16
+#define LZ_CHAIN_DEPTH		64
+
+static inline quint32 lzHash(const uchar* p) {
+	const quint32 v = p[0] | (p[1] << 8) | (p[2] << 16) | ((quint32)p[3] << 24);
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Writes the part of a length that didn't fit in its nibble
+static void writeLength(QByteArray& out, int length) {
+	for (; length >= 255; length -= 255)
+		out.append((char)255);
+	out.append((char)length);
+}
+
+static void writeSequence(QByteArray& out, const uchar* literals, int literalCount, int offset, int matchLength) {
+	const int matchCode = matchLength - LZ_MIN_MATCH;
+	out.append((char)((qMin(literalCount, 15) << 4) | (matchLength ? qMin(matchCode, 15) : 0)));
+	if (literalCount >= 15)
+		writeLength(out, literalCount - 15);
+	out.append((const char*)literals, literalCount);
+	if (matchLength) {
+		out.append((char)(offset & 0xff));
+		out.append((char)(offset >> 8));
+		if (matchCode >= 15)
+			writeLength(out, matchCode - 15);
+	}
+}
+
+QByteArray lzCompress(const QByteArray& input) {
+	const uchar* src = (const uchar*)input.constData();
+	const int size = input.size();
+
+	QByteArray out;
+	out.reserve(size + size / 255 + 16);
+
+	QVector<int> head(1 << LZ_HASH_BITS, -1);	// Latest position with each hash
+	QVector<int> chain(size);					// The one before that, for each position
+
+	int anchor = 0;		// Start of the literals that haven't been written yet
+	int pos = 0;
+	int hashed = 0;		// Positions before this are in the chains
+	while (pos + LZ_MATCH_LIMIT <= size) {
+		for (; hashed <= pos; hashed++) {
+			const quint32 h = lzHash(src + hashed);
+			chain[hashed] = head[h];
+			head[h] = hashed;
+		}
+
+		// Longest earlier match, nearest one first
+		const int maxLength = size - LZ_LAST_LITERALS - pos;
+		int bestLength = 0;
+		int bestOffset = 0;
+		int candidate = chain[pos];
+		for (int depth=0; depth<LZ_CHAIN_DEPTH && candidate >= 0 && pos - candidate <= LZ_MAX_OFFSET; depth++) {
+			if (src[candidate + bestLength] == src[pos + bestLength]) {
+				int length = 0;
+				while (length < maxLength && src[candidate + length] == src[pos + length])
+					length++;
+				if (length > bestLength) {
+					bestLength = length;
+					bestOffset = pos - candidate;
+					if (length == maxLength)
+						break;
+				}
+			}
+			candidate = chain[candidate];
+		}
+
+		if (bestLength < LZ_MIN_MATCH) {
+			pos++;
+			continue;
+		}
+
+		writeSequence(out, src + anchor, pos - anchor, bestOffset, bestLength);
+		pos += bestLength;
+		anchor = pos;
+
+		// Positions inside the match can still be matched later on
+		for (; hashed < pos && hashed + LZ_MATCH_LIMIT <= size; hashed++) {
+			const quint32 h = lzHash(src + hashed);
+			chain[hashed] = head[h];
+			head[h] = hashed;
+		}
+		hashed = pos;
+	}
+
+	writeSequence(out, src + anchor, size - anchor, 0, 0);
+	return out;
+}
+
+// Kept to plain C so it can be used as is on the target
+bool lzDecompress(const uchar* src, int srcSize, uchar* dst, int dstSize) {
+	const uchar* srcEnd = src + srcSize;
+	uchar* out = dst;
+	uchar* outEnd = dst + dstSize;
+
+	while (src < srcEnd) {
+		const int token = *src++;
+
+		// Copy the literals
+		int length = token >> 4;
+		if (length == 15) {
+			int extra;
+			do {
+				if (src == srcEnd)
+					return false;
+				extra = *src++;
+				length += extra;
+			} while (extra == 255);
+		}
+		if (length > srcEnd - src || length > outEnd - out)
+			return false;
+		memcpy(out, src, length);
+		out += length;
+		src += length;
+
+		// The last sequence has no match
+		if (src == srcEnd)
+			break;
+
+		// Copy the match. It can overlap the output, so go byte by byte.
+		if (srcEnd - src < 2)
+			return false;
+		const int offset = src[0] | (src[1] << 8);
+		src += 2;
+		if (offset == 0 || offset > out - dst)
+			return false;
+		length = token & 15;
+		if (length == 15) {
+			int extra;
+			do {
+				if (src == srcEnd)
+					return false;
+				extra = *src++;
+				length += extra;
+			} while (extra == 255);
+		}
+		length += LZ_MIN_MATCH;
+		if (length > outEnd - out)
+			return false;
+		const uchar* match = out - offset;
+		while (length--)
+			*out++ = *match++;
+	}
+
+	return out == outEnd;
+}
+
+QByteArray lzPackTexture(const QByteArray& texture) {
+	const QByteArray data = lzCompress(texture.mid(16));
+
+	QByteArray container;
+	container.reserve(LZTEXTURE_HEADER_SIZE + 16 + data.size());
+	container.append(LZTEXTURE_MAGIC, 4);
+	const qint32 compressedSize = qToLittleEndian<qint32>(data.size());
+	container.append((const char*)&compressedSize, 4);
+	container.append(texture.constData(), 16);
+	container.append(data);
+	return container;
+}
+
+bool lzUnpackTexture(const QByteArray& container, QByteArray& texture) {
+	TextureHeader header;
+	if (container.size() < LZTEXTURE_HEADER_SIZE + 16 || memcmp(container.constData(), LZTEXTURE_MAGIC, 4) != 0
+		|| !readTextureHeader(container.mid(LZTEXTURE_HEADER_SIZE, 16), header))
+		return false;
+
+	// The size comes from the file, so only take the exact size the type
+	// needs before allocating anything. readTextureHeader() has already
+	// checked that it fits in VRAM.
+	if (header.size != calculateSize(header.width, header.height, header.textureType))
+		return false;
+	const int compressedSize = qFromLittleEndian<qint32>((const uchar*)container.constData() + 4);
+	if (compressedSize < 0 || compressedSize > container.size() - LZTEXTURE_HEADER_SIZE - 16)
+		return false;
+
+	texture.resize(16 + header.size);
+	memcpy(texture.data(), container.constData() + LZTEXTURE_HEADER_SIZE, 16);
+	return lzDecompress((const uchar*)container.constData() + LZTEXTURE_HEADER_SIZE + 16, compressedSize, (uchar*)texture.data() + 16, header.size);
+}
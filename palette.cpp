@@ -18,21 +18,22 @@ void Palette::insert(const QRgb color) {
 		colors.insert(color, colors.size());
 }
 
+QVector<QRgb> Palette::colorTable() const {
+	QVector<QRgb> table(256, qRgb(0, 0, 0));
+	for (QHash<QRgb, int>::const_iterator it=colors.constBegin(); it!=colors.constEnd(); ++it) {
+		if (it.value() >= 0 && it.value() < table.size())
+			table[it.value()] = it.key();
+	}
+	return table;
+}
+
 bool Palette::save(const QString& filename) const {
 	QFile file(filename);
 
 	if (file.open(QIODevice::WriteOnly)) {
 		QDataStream out(&file);
 		out.setByteOrder(QDataStream::LittleEndian);
-
-		// Write header
-		out.writeRawData(PALETTE_MAGIC, 4);
-		out << (qint32)colors.size();
-
-		// Write the colors
-		for (int i=0; i<colors.size(); i++)
-			out << (quint32)colors.key(i);
-
+		save(out);
 		file.close();
 		return true;
 	}
@@ -41,32 +42,25 @@ bool Palette::save(const QString& filename) const {
 	return false;
 }
 
+void Palette::save(QDataStream& out) const {
+	// Write header
+	out.writeRawData(PALETTE_MAGIC, 4);
+	out << (qint32)colors.size();
+
+	// Write the colors
+	for (int i=0; i<colors.size(); i++)
+		out << (quint32)colors.key(i);
+}
+
 bool Palette::load(const QString& filename) {
 	QFile file(filename);
 
 	if (file.open(QIODevice::ReadOnly)) {
-		char magic[4];
-		qint32 numColors = 0;
-
 		QDataStream in(&file);
-		in.setByteOrder(QDataStream::LittleEndian);
-
-		// Read header
-		in.readRawData(magic, 4);
-		if (memcmp(magic, PALETTE_MAGIC, 4) != 0) {
+		if (!load(in)) {
 			qCritical() << filename << "is not a valid palette file";
 			return false;
 		}
-		in >> numColors;
-
-		// Read colors
-		colors.clear();
-		for (int i=0; i<numColors; i++) {
-			quint32 color = 0xFF000000;
-			in >> color;
-			colors.insert((QRgb)color, i);
-		}
-
 		file.close();
 		return true;
 	}
@@ -74,3 +68,25 @@ bool Palette::load(const QString& filename) {
 	qCritical() << "Failed to open" << filename;
 	return false;
 }
+
+bool Palette::load(QDataStream& in) {
+	char magic[4];
+	qint32 numColors = 0;
+
+	in.setByteOrder(QDataStream::LittleEndian);
+
+	// Read header
+	if (in.readRawData(magic, 4) != 4 || memcmp(magic, PALETTE_MAGIC, 4) != 0)
+		return false;
+	in >> numColors;
+
+	// Read colors
+	colors.clear();
+	for (int i=0; i<numColors && in.status() == QDataStream::Ok; i++) {
+		quint32 color = 0xFF000000;
+		in >> color;
+		colors.insert((QRgb)color, i);
+	}
+
+	return in.status() == QDataStream::Ok;
+}
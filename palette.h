@@ -4,8 +4,10 @@
 #include <QtGlobal>
 #include <QHash>
 #include <QColor>
+#include <QVector>
 
 class ImageContainer;
+class QDataStream;
 
 class Palette {
 public:
@@ -21,9 +23,15 @@ public:
 
 	int indexOf(const QRgb color) const { return colors.value(color, 0); }
 	QRgb colorAt(const int index) const { return colors.key(index, qRgb(0, 0, 0)); }
+	// The colors by index, for all 256 indices. Unused ones are black,
+	// just like with colorAt(). Much faster for looking up a lot of them.
+	QVector<QRgb> colorTable() const;
 
 	bool load(const QString& filename);
+	// Reads a palette laid out like a palette file
+	bool load(QDataStream& stream);
 	bool save(const QString& filename) const;
+	void save(QDataStream& stream) const;
 
 private:
 	// "Color" <=> "Palette index"
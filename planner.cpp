@@ -0,0 +1,316 @@
+#include "common.h"
+#include "imagecontainer.h"
+#include "vqtools.h"
+
+#include <QFile>
+#include <QFileInfo>
+#include <QSet>
+#include <QTextStream>
+#include <QDebug>
+#include <QtConcurrent>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <random>
+
+// Number of 4x4 pixel blocks sampled from each image for the error estimates
+#define PLAN_SAMPLE_BLOCKS	1024
+
+// Number of codes trained on the sample. The error for the real number of
+// codes is extrapolated from this.
+#define PLAN_SAMPLE_CODES	32
+
+// The budget is solved for in at most this many steps
+#define PLAN_BUDGET_STEPS	4096
+
+// An input image and the size and estimated error of every choice for it
+struct PlanItem {
+	QString			filename;
+	int				width;
+	int				height;
+	int				channels;	// 4 if the image has any transparency, otherwise 3
+	QVector<int>	sizes;
+	QVector<double>	errors;		// Squared error per pixel, summed over the channels
+	bool			ok;
+};
+
+static double pixelError(QRgb a, QRgb b, bool alpha) {
+	const int dr = qRed(a) - qRed(b);
+	const int dg = qGreen(a) - qGreen(b);
+	const int db = qBlue(a) - qBlue(b);
+	const int da = alpha ? (qAlpha(a) - qAlpha(b)) : 0;
+	return dr * dr + dg * dg + db * db + da * da;
+}
+
+// Counts the unique blocks of blockWidth x blockHeight pixels in the image.
+// The blocks are compared by hash, which is close enough for an estimate.
+static int countUniqueBlocks(const QImage& img, int blockWidth, int blockHeight) {
+	QSet<uint> blocks;
+	for (int y=0; y<img.height(); y+=blockHeight) {
+		for (int x=0; x<img.width(); x+=blockWidth) {
+			uint hash = 0;
+			for (int yy=y; yy<(y+blockHeight); yy++)
+				for (int xx=x; xx<(x+blockWidth); xx++)
+					hash = combineHash(img.pixel(xx, yy), hash);
+			blocks.insert(hash);
+		}
+	}
+	return blocks.size();
+}
+
+// Average error per pixel of the 16-bit texel conversion of the sample.
+static double roundingError(const QVector<QRgb>& sample, int pixelFormat, bool alpha) {
+	double error = 0.0;
+	for (int i=0; i<sample.size(); i+=2) {
+		QRgb a, b;
+		if (pixelFormat == PIXELFORMAT_YUV422) {
+			// Horizontal pairs share their U and V
+			quint16 yuv1, yuv2;
+			RGBtoYUV422(sample[i], sample[i + 1], yuv1, yuv2);
+			YUV422toRGB(yuv1, yuv2, a, b);
+		} else {
+			a = to32BPP(to16BPP(sample[i], pixelFormat), pixelFormat);
+			b = to32BPP(to16BPP(sample[i + 1], pixelFormat), pixelFormat);
+		}
+		error += pixelError(sample[i], a, alpha) + pixelError(sample[i + 1], b, alpha);
+	}
+	return error / sample.size();
+}
+
+// Estimates the average error per pixel of quantizing the image's
+// blockWidth x blockHeight pixel blocks to 'codes' codes. A codebook of at
+// most PLAN_SAMPLE_CODES codes is trained on the sample instead, and the
+// error is extrapolated from there.
+template<uint N>
+static double quantizationError(const QVector<QRgb>& sample, int blockWidth, int blockHeight, int uniqueBlocks, int codes, const VQSettings& vqSettings) {
+	if (uniqueBlocks <= codes)
+		return 0.0;
+
+	// The sample is made of 4x4 blocks, so split those up
+	VecStore<N> vectors;
+	for (int i=0; i<sample.size(); i+=16) {
+		for (int y=0; y<4; y+=blockHeight) {
+			for (int x=0; x<4; x+=blockWidth) {
+				Vec<N> vec;
+				uint hash = 0;
+				int offset = 0;
+				for (int yy=y; yy<(y+blockHeight); yy++) {
+					for (int xx=x; xx<(x+blockWidth); xx++) {
+						const QRgb pixel = sample[i + yy * 4 + xx];
+						argb2vec(pixel, vec, offset);
+						hash = combineHash(pixel, hash);
+						offset += 4;
+					}
+				}
+				vectors.push_back(vec, hash);
+			}
+		}
+	}
+
+	const int trained = qMin(codes, PLAN_SAMPLE_CODES);
+	VectorQuantizer<N> vq(vqSettings);
+	vq.compress(vectors, trained);
+	const double error = vq.distortion() * 255.0 * 255.0 / sample.size();
+	if (trained == codes || error <= 0.0)
+		return error;
+
+	// Measure how fast the error falls off with a smaller codebook, and
+	// extrapolate from there
+	vq.clear();
+	vq.compress(vectors, trained / 4);
+	const double smallerError = vq.distortion() * 255.0 * 255.0 / sample.size();
+	const double falloff = (smallerError > error) ? (log(smallerError / error) / log(4.0)) : 0.0;
+	return error * pow((double)codes / trained, -falloff);
+}
+
+// Loads the image and estimates the size and error of every choice.
+static bool estimateChoices(PlanItem& item, const QVector<int>& textureTypes, const VQSettings& vqSettings) {
+	ImageContainer images;
+	if (!images.load(QStringList() << item.filename, textureTypes.first() & FLAG_MIPMAPPED, Qt::SmoothTransformation))
+		return false;
+	const QImage img = images.getByIndex(0, false);
+	item.width = images.width();
+	item.height = images.height();
+
+	bool alpha = false;
+	for (int y=0; y<img.height() && !alpha; y++)
+		for (int x=0; x<img.width() && !alpha; x++)
+			alpha = (qAlpha(img.pixel(x, y)) < 255);
+	item.channels = alpha ? 4 : 3;
+
+	// Sample 4x4 blocks, one at random from each of 'sampleCount' equal runs
+	// of blocks. Evenly spaced blocks would line up with the image's rows.
+	const int blocksPerRow = img.width() / 4;
+	const int blockCount = blocksPerRow * (img.height() / 4);
+	const int sampleCount = qMin(blockCount, PLAN_SAMPLE_BLOCKS);
+	std::mt19937 rng(vqSettings.seed);
+	QVector<QRgb> sample;
+	sample.reserve(sampleCount * 16);
+	for (int i=0; i<sampleCount; i++) {
+		const int first = (int)((qint64)i * blockCount / sampleCount);
+		const int last = (int)((qint64)(i + 1) * blockCount / sampleCount);
+		const int block = first + (int)(rng() % (quint32)(last - first));
+		const int x = (block % blocksPerRow) * 4;
+		const int y = (block / blocksPerRow) * 4;
+		for (int yy=y; yy<(y+4); yy++)
+			for (int xx=x; xx<(x+4); xx++)
+				sample.push_back(img.pixel(xx, yy));
+	}
+
+	// Only estimate what the choices need, and only once
+	QHash<int, double> colorErrors;
+	QHash<int, double> roundingErrors;
+	double blockError[3] = { -1.0, -1.0, -1.0 };	// 2x2, 2x4 and 4x4 blocks
+
+	foreach (int textureType, textureTypes) {
+		const int pixelFormat = (textureType >> PIXELFORMAT_SHIFT) & PIXELFORMAT_MASK;
+		const bool compressed = (textureType & FLAG_COMPRESSED);
+		double e = 0.0;
+
+		if (isPaletted(textureType)) {
+			const int colors = (pixelFormat == PIXELFORMAT_PAL4BPP) ? 16 : 256;
+			if (!colorErrors.contains(colors))
+				colorErrors.insert(colors, quantizationError<4>(sample, 1, 1, countUniqueBlocks(img, 1, 1), colors, vqSettings));
+			e = colorErrors.value(colors);
+
+			if (compressed && pixelFormat == PIXELFORMAT_PAL4BPP) {
+				if (blockError[2] < 0.0)
+					blockError[2] = quantizationError<64>(sample, 4, 4, countUniqueBlocks(img, 4, 4), vqSettings.codes, vqSettings);
+				e += blockError[2];
+			} else if (compressed) {
+				if (blockError[1] < 0.0)
+					blockError[1] = quantizationError<32>(sample, 2, 4, countUniqueBlocks(img, 2, 4), vqSettings.codes, vqSettings);
+				e += blockError[1];
+			}
+		} else {
+			if (!roundingErrors.contains(pixelFormat))
+				roundingErrors.insert(pixelFormat, roundingError(sample, pixelFormat, alpha));
+			e = roundingErrors.value(pixelFormat);
+
+			if (compressed) {
+				if (blockError[0] < 0.0)
+					blockError[0] = quantizationError<16>(sample, 2, 2, countUniqueBlocks(img, 2, 2), vqSettings.codes, vqSettings);
+				e += blockError[0];
+			}
+		}
+
+		item.sizes.push_back(calculateSize(item.width, item.height, textureType));
+		item.errors.push_back(e);
+	}
+
+	return true;
+}
+
+// Picks one choice per item so that the sizes add up to at most 'budget'
+// with the least total error, which is a multiple-choice knapsack problem.
+// The sizes are rounded up to whole steps of the budget, so the picks always
+// fit. Returns false if even the smallest choices don't fit.
+static bool solve(const QVector<PlanItem>& items, qint64 budget, QVector<int>& picks) {
+	const qint64 unit = qMax((qint64)32, (budget + PLAN_BUDGET_STEPS - 1) / PLAN_BUDGET_STEPS);
+	const int steps = (int)(budget / unit);
+	const double none = std::numeric_limits<double>::infinity();
+
+	// best[j] is the least error of the items so far in at most j steps,
+	// and choices[i][j] what item i picked to get there.
+	QVector<double> best(steps + 1, 0.0);
+	QVector<QVector<qint8>> choices(items.size());
+	for (int i=0; i<items.size(); i++) {
+		const PlanItem& item = items[i];
+		const double pixels = (double)item.width * item.height;
+		QVector<double> next(steps + 1, none);
+		choices[i].fill(-1, steps + 1);
+		for (int c=0; c<item.sizes.size(); c++) {
+			const int weight = (int)((item.sizes[c] + unit - 1) / unit);
+			const double error = item.errors[c] * pixels;
+			for (int j=weight; j<=steps; j++) {
+				if (best[j - weight] + error < next[j]) {
+					next[j] = best[j - weight] + error;
+					choices[i][j] = c;
+				}
+			}
+		}
+		best = next;
+	}
+
+	if (best[steps] == none)
+		return false;
+
+	picks.resize(items.size());
+	int j = steps;
+	for (int i=items.size()-1; i>=0; i--) {
+		const int c = choices[i][j];
+		picks[i] = c;
+		j -= (int)((items[i].sizes[c] + unit - 1) / unit);
+	}
+	return true;
+}
+
+static double estimatedPSNR(double error, int channels) {
+	if (error <= 0.0)
+		return 100.0;
+	return 10.0 * log10((255.0 * 255.0) / (error / channels));
+}
+
+bool planTextures(const QStringList& filenames, const QVector<int>& textureTypes, const QStringList& formatNames, qint64 budget, const QString& manifestFilename, const VQSettings& vqSettings, const QString& arguments) {
+	QVector<PlanItem> items(filenames.size());
+	for (int i=0; i<filenames.size(); i++) {
+		items[i].filename = filenames[i];
+		items[i].ok = false;
+	}
+
+	// The images are independent, so estimate them all at the same time
+	QtConcurrent::blockingMap(items, [&textureTypes, &vqSettings](PlanItem& item) {
+		item.ok = estimateChoices(item, textureTypes, vqSettings);
+	});
+
+	qint64 smallest = 0;
+	for (int i=0; i<items.size(); i++) {
+		const PlanItem& item = items[i];
+		if (!item.ok)
+			return false;
+		smallest += *std::min_element(item.sizes.begin(), item.sizes.end());
+		for (int c=0; c<item.sizes.size(); c++)
+			qDebug("%s as %s: %d bytes, ~%.2f dB", qPrintable(item.filename), qPrintable(formatNames[c]), item.sizes[c], estimatedPSNR(item.errors[c], item.channels));
+	}
+
+	QVector<int> picks;
+	if (!solve(items, budget, picks)) {
+		qCritical("The textures don't fit in %lld bytes, they need at least %lld", budget, smallest);
+		return false;
+	}
+
+	QFile file(manifestFilename);
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Text)) {
+		qCritical() << "Failed to open" << manifestFilename;
+		return false;
+	}
+
+	qint64 used = 0;
+	for (int i=0; i<items.size(); i++)
+		used += items[i].sizes[picks[i]];
+
+	// One line of arguments per texture, with a comment line in front
+	QTextStream stream(&file);
+	stream << "# " << items.size() << " textures, " << used << " of " << budget << " bytes\n";
+	for (int i=0; i<items.size(); i++) {
+		const PlanItem& item = items[i];
+		const int c = picks[i];
+		const QFileInfo info(item.filename);
+		const QString out = info.path() + "/" + info.completeBaseName() + ".tex";
+		const double psnr = estimatedPSNR(item.errors[c], item.channels);
+
+		stream << "# " << item.filename << ": " << item.sizes[c] << " bytes, ~" << QString::number(psnr, 'f', 2) << " dB\n";
+		stream << "-in \"" << item.filename << "\" -out \"" << out << "\" -format " << formatNames[c];
+		if (textureTypes[c] & FLAG_MIPMAPPED)
+			stream << " -mipmap";
+		if (!arguments.isEmpty())
+			stream << " " << arguments;
+		stream << "\n";
+		qDebug("Picked %s for %s, %d bytes, ~%.2f dB", qPrintable(formatNames[c]), qPrintable(item.filename), item.sizes[c], psnr);
+	}
+
+	qDebug("Planned %d textures, %lld of %lld bytes", items.size(), used, budget);
+	qDebug() << "Saved plan" << manifestFilename;
+	return true;
+}
@@ -0,0 +1,98 @@
+#include "texconv.h"
+
+#include <QBuffer>
+#include <QDataStream>
+#include <QDebug>
+
+bool checkStride(int textureType) {
+	if (textureType & FLAG_STRIDED) {
+		if (textureType & FLAG_COMPRESSED) {
+			qCritical() << "Stride textures can't be compressed.";
+			return false;
+		}
+		if (!(textureType & FLAG_NONTWIDDLED)) {
+			qCritical() << "Stride textures can't be twiddled.";
+			return false;
+		}
+		if (textureType & FLAG_MIPMAPPED) {
+			qCritical() << "Stride textures can't have mipmaps.";
+			return false;
+		}
+		if (isPaletted(textureType) || isFormat(textureType, PIXELFORMAT_BUMPMAP)) {
+			qCritical() << "Only RGB565, ARGB1555, ARGB4444 and YUV422 can be strided.";
+			return false;
+		}
+	}
+	return true;
+}
+
+bool encode(const ImageContainer& images, const EncodeOptions& options, EncodedTexture& result) {
+	int textureType = options.textureType;
+	if (images.imageCount() == 0) {
+		qCritical("There are no images to convert");
+		return false;
+	}
+	if (!checkStride(textureType))
+		return false;
+
+	// Now that the width is known the stride setting can go in the texture
+	// type field (bits 0-4).
+	if (textureType & FLAG_STRIDED)
+		textureType |= (images.width() / 32);
+
+	// Paletted textures pick their colors from all colors in the images
+	Palette colors;
+	if (isPaletted(textureType) && !options.colors)
+		colors = Palette(images);
+	const Palette& allColors = options.colors ? *options.colors : colors;
+
+	// Convert the texture data. The header depends on the size of the
+	// codebook, so it can't be written until this is done.
+	QByteArray data;
+	QBuffer dataBuffer(&data);
+	dataBuffer.open(QIODevice::WriteOnly);
+	QDataStream dataStream(&dataBuffer);
+	dataStream.setByteOrder(QDataStream::LittleEndian);
+	result.palette.clear();
+	int codes;
+	if (isPaletted(textureType)) {
+		codes = convertPaletted(dataStream, images, allColors, textureType, result.palette, options.vqSettings);
+	} else {
+		codes = convert16BPP(dataStream, images, textureType, options.vqSettings);
+	}
+	if (textureType & FLAG_COMPRESSED) {
+		textureType |= codebookSetting(codes);
+	}
+
+	result.texture.clear();
+	QBuffer textureBuffer(&result.texture);
+	textureBuffer.open(QIODevice::WriteOnly);
+	QDataStream stream(&textureBuffer);
+	stream.setByteOrder(QDataStream::LittleEndian);
+
+	// Write texture header and data
+	const int expectedSize = writeTextureHeader(stream, images.width(), images.height(), textureType);
+	stream.writeRawData(data.constData(), data.size());
+
+	// Pad the texture data block to 32 bytes
+	const int padding = expectedSize - data.size();
+	if (padding > 0) {
+		if (padding >= 32)
+			qWarning() << "Padding is" << padding << "but it should be less than 32!";
+		writeZeroes(stream, padding);
+		qDebug() << "Added" << padding << "bytes of padding";
+	}
+
+	// The palette file is only made for paletted textures
+	result.paletteData.clear();
+	if (isPaletted(textureType)) {
+		QBuffer paletteBuffer(&result.paletteData);
+		paletteBuffer.open(QIODevice::WriteOnly);
+		QDataStream paletteStream(&paletteBuffer);
+		paletteStream.setByteOrder(QDataStream::LittleEndian);
+		result.palette.save(paletteStream);
+	}
+
+	result.textureType = textureType;
+	return true;
+}
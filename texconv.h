@@ -0,0 +1,49 @@
+#ifndef TEXCONV_H
+#define TEXCONV_H
+
+// The libtexconv API. Converts images to textures in memory, so other tools
+// can link the converter instead of running texconv on files.
+//
+//	ImageContainer images;
+//	images.load(QVector<QImage>() << img, "name", textureType, Qt::SmoothTransformation);
+//
+//	EncodeOptions options;
+//	options.textureType = textureType;
+//	EncodedTexture encoded;
+//	if (encode(images, options, encoded))
+//		...use encoded.texture and encoded.paletteData...
+
+#include <QByteArray>
+
+#include "archive.h"
+#include "common.h"
+#include "imagecontainer.h"
+#include "palette.h"
+#include "vqtools.h"
+
+// How to convert a texture
+struct EncodeOptions {
+	EncodeOptions() : textureType(0), colors(nullptr) {}
+
+	int			textureType;	// Pixel format and flags. encode() adds the stride setting.
+	VQSettings	vqSettings;		// Used for compression and color reduction
+	const Palette*	colors;		// All colors in the images for paletted textures, or nullptr to count them
+};
+
+// A converted texture
+struct EncodedTexture {
+	int			textureType;	// The type in the header
+	QByteArray	texture;		// The header and texture data, like a texture file
+	Palette		palette;		// The palette of a paletted texture
+	QByteArray	paletteData;	// 'palette' laid out like a palette file
+};
+
+// Stride textures have a lot of restraints. Prints what's wrong and returns
+// false if 'textureType' breaks one of them.
+bool checkStride(int textureType);
+
+// Converts the images, which must have been loaded for options.textureType,
+// to a texture. Returns false if they can't be.
+bool encode(const ImageContainer& images, const EncodeOptions& options, EncodedTexture& result);
+
+#endif // TEXCONV_H
@@ -0,0 +1,40 @@
+# The converter itself, shared by texconv and libtexconv
+
+QT += concurrent
+
+CONFIG += c++11
+
+QMAKE_CXXFLAGS += -std=c++11 \
+
+#Required to get C++11x to work on OSX
+macx {
+  QMAKE_CXXFLAGS += -mmacosx-version-min=10.7 -stdlib=libc++
+  LIBS += -mmacosx-version-min=10.7 -stdlib=libc++
+}
+
+INCLUDEPATH += $$PWD
+
+SOURCES += \
+    $$PWD/preview.cpp \
+    $$PWD/decoder.cpp \
+    $$PWD/inspect.cpp \
+    $$PWD/archive.cpp \
+    $$PWD/lz.cpp \
+    $$PWD/palette.cpp \
+    $$PWD/twiddler.cpp \
+    $$PWD/common.cpp \
+    $$PWD/imagecontainer.cpp \
+    $$PWD/conv16bpp.cpp \
+    $$PWD/convpal.cpp \
+    $$PWD/planner.cpp \
+    $$PWD/atlas.cpp \
+    $$PWD/texconv.cpp
+
+HEADERS += \
+    $$PWD/texconv.h \
+    $$PWD/archive.h \
+	$$PWD/vqtools.h \
+    $$PWD/palette.h \
+    $$PWD/twiddler.h \
+    $$PWD/common.h \
+    $$PWD/imagecontainer.h
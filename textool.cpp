@@ -17,14 +17,54 @@
 #include <QStringList>
 #include <QHash>
 #include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QDirIterator>
+#include <QElapsedTimer>
+#include <QFileSystemWatcher>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTimer>
+#include <QTextStream>
 #include <QDebug>
+#include <QMap>
+#include <QMutex>
+#include <QSet>
+#include <QSharedPointer>
+#include <QtConcurrent>
 
 #include <iostream>
+#include <cmath>
+#include <cstring>
+#include <limits>
 
-#include "common.h"
-#include "imagecontainer.h"
+#ifdef Q_OS_WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+#include "texconv.h"
 
 static bool g_verbose = false;
+static bool g_stdoutTaken = false;	// stdout is taken by -serve or -info
+
+// Frame identifiers for -serve
+#define SERVE_REQUEST_MAGIC		"TCRQ"
+#define SERVE_RESPONSE_MAGIC	"TCRS"
+
+// Largest -serve requests that are taken. Larger parts are skipped, and the
+// job fails.
+#define SERVE_MAX_ARGS_SIZE		(64 * 1024)
+#define SERVE_MAX_IMAGE_SIZE	(64 * 1024 * 1024)
+#define SERVE_MAX_IMAGES		16
+
+// How long -watch waits for a burst of file changes to end
+#define WATCH_DEBOUNCE_MS		250
+
+// -lz-benchmark decompresses each texture until about this many bytes have
+// come out, so small textures get steady timings too
+#define LZ_BENCHMARK_BYTES		(16 * 1024 * 1024)
 
 // Allow for colored output on unix systems
 #ifndef Q_OS_WIN32
@@ -42,7 +82,7 @@ void messageHandler(QtMsgType type, const QMessageLogContext& context, const QSt
 	switch (type) {
 	case QtDebugMsg:
 		if (g_verbose)
-			std::cout << qPrintable(msg) << std::endl;
+			(g_stdoutTaken ? std::cerr : std::cout) << qPrintable(msg) << std::endl;
 		break;
 	case QtWarningMsg:
 		std::cerr << YELLOWCOLOR << "[WARNING] " << qPrintable(msg) << NOCOLOR << std::endl;
@@ -56,6 +96,1098 @@ void messageHandler(QtMsgType type, const QMessageLogContext& context, const QSt
 	}
 }
 
+// One texture to convert
+struct OutputTexture {
+	QString		filename;
+	QString		paletteFilename;
+	QString		previewFilename;
+	QString		codeUsageFilename;
+	int			textureType;
+	bool		autoFormat;		// Pick the format with -min-psnr
+	Qt::TransformationMode	mipmapFilter;
+	const ImageContainer*	images;
+	const Palette*			colors;		// All colors in 'images', for paletted textures
+	EncodedTexture	encoded;	// The converted texture, if it's already done
+	bool		lz;			// Save it as an LZ texture
+	bool		ok;
+};
+
+// A format to try for -format auto
+struct Candidate {
+	QString		name;
+	int			textureType;
+	int			expectedSize;	// The smallest the texture can be
+	const ImageContainer*	images;
+	const Palette*			colors;
+	EncodedTexture	encoded;
+	double		psnr;
+};
+
+// The settings of one -serve or -watch job
+struct JobSettings {
+	EncodeOptions	options;
+	Qt::TransformationMode	mipmapFilter;
+	bool			lz;
+};
+
+// A line of the -watch rules file. Files matching 'pattern' are converted
+// with the options in 'args'.
+struct WatchRule {
+	QString		pattern;
+	QStringList	args;
+	JobSettings	job;
+};
+
+// A file -watch has seen, and the rule it was last converted with
+struct WatchSource {
+	qint64		modified;
+	qint64		size;
+	QStringList	args;
+};
+
+// Loaded images that -watch keeps while their file stays the same, and the
+// settings they were loaded with
+struct CachedImages {
+	qint64		modified;
+	qint64		size;
+	int			flags;	// FLAG_MIPMAPPED and FLAG_STRIDED
+	Qt::TransformationMode	mipmapFilter;
+	ImageContainer	images;
+};
+
+// What -watch keeps between conversions. The workers only use the members
+// after 'mutex', and only while holding it.
+struct WatchState {
+	QString		dir;
+	QString		rulesFilename;
+	QVector<WatchRule>			rules;
+	QHash<QString, WatchSource>	sources;
+	QMutex		mutex;
+	QSet<QString>				running;	// Files being converted
+	QHash<QString, JobSettings>	rerun;		// Files that changed while being converted
+	QHash<QString, QSharedPointer<CachedImages> >	cache;	// One per file
+};
+
+// PSNR of the decoded mipmap levels against the source images. Alpha only
+// counts if the source images have any transparency.
+static double measurePSNR(const ImageContainer& images, const QVector<QImage>& decoded) {
+	bool alpha = false;
+	for (int i=0; i<images.imageCount() && !alpha; i++) {
+		const QImage img = images.getByIndex(i);
+		for (int y=0; y<img.height() && !alpha; y++)
+			for (int x=0; x<img.width() && !alpha; x++)
+				alpha = (qAlpha(img.pixel(x, y)) < 255);
+	}
+
+	double error = 0.0;
+	qint64 samples = 0;
+	for (int i=0; i<decoded.size(); i++) {
+		const QImage& dec = decoded[i];
+		const QImage src = images.getBySize(dec.width());
+		for (int y=0; y<dec.height(); y++) {
+			for (int x=0; x<dec.width(); x++) {
+				const QRgb a = src.pixel(x, y);
+				const QRgb b = dec.pixel(x, y);
+				const int dr = qRed(a) - qRed(b);
+				const int dg = qGreen(a) - qGreen(b);
+				const int db = qBlue(a) - qBlue(b);
+				const int da = alpha ? (qAlpha(a) - qAlpha(b)) : 0;
+				error += dr * dr + dg * dg + db * db + da * da;
+				samples += alpha ? 4 : 3;
+			}
+		}
+	}
+
+	if (samples == 0)
+		return 0.0;
+	if (error == 0.0)
+		return 100.0;
+	return 10.0 * log10((255.0 * 255.0) / (error / samples));
+}
+
+// Converts the candidates from smallest to largest expected size, and picks
+// the smallest one that reaches 'minPSNR'. Candidates that can't be smaller
+// than one that already made it are skipped. Returns -1 if there are no
+// candidates to pick from.
+static int chooseCandidate(QVector<Candidate>& candidates, double minPSNR, const VQSettings& vqSettings) {
+	std::stable_sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b) {
+		return a.expectedSize < b.expectedSize;
+	});
+
+	QMutex mutex;
+	int passedSize = std::numeric_limits<int>::max();
+	QtConcurrent::blockingMap(candidates, [&mutex, &passedSize, minPSNR, &vqSettings](Candidate& candidate) {
+		candidate.psnr = -1.0;
+		{
+			QMutexLocker locker(&mutex);
+			if (candidate.expectedSize > passedSize)
+				return;
+		}
+
+		EncodeOptions options;
+		options.textureType = candidate.textureType;
+		options.vqSettings = vqSettings;
+		options.colors = candidate.colors;
+		if (!encode(*candidate.images, options, candidate.encoded))
+			return;
+		QVector<QImage> decoded;
+		if (!decodeTexture(candidate.encoded.texture, candidate.encoded.palette, &decoded, NULL))
+			return;
+		candidate.psnr = measurePSNR(*candidate.images, decoded);
+		qDebug("%s: %d bytes, %.2f dB", qPrintable(candidate.name), candidate.encoded.texture.size(), candidate.psnr);
+
+		if (candidate.psnr >= minPSNR) {
+			QMutexLocker locker(&mutex);
+			passedSize = qMin(passedSize, candidate.encoded.texture.size());
+		}
+	});
+
+	// Smallest one that made it, the highest PSNR if there's a tie. If none
+	// of them made it, take the one with the highest PSNR.
+	int best = -1;
+	for (int i=0; i<candidates.size(); i++) {
+		const Candidate& c = candidates[i];
+		if (c.psnr < minPSNR)
+			continue;
+		if (best == -1 || c.encoded.texture.size() < candidates[best].encoded.texture.size() ||
+			(c.encoded.texture.size() == candidates[best].encoded.texture.size() && c.psnr > candidates[best].psnr))
+			best = i;
+	}
+	if (best == -1) {
+		for (int i=0; i<candidates.size(); i++)
+			if (candidates[i].psnr >= 0.0 && (best == -1 || candidates[i].psnr > candidates[best].psnr))
+				best = i;
+		if (best != -1)
+			qWarning("No format reaches %.2f dB, using %s at %.2f dB", minPSNR, qPrintable(candidates[best].name), candidates[best].psnr);
+	}
+
+	return best;
+}
+
+// Determine what mode of filtering we're gonna do for mipmaps.
+// We're doing nearest-neighbor for paletted images to avoid introducing more colors.
+// It should probably be done for lossless vq textures as well, but there's no way of
+// knowing if we're gonna output one of those at this stage, so that's up to the user.
+static Qt::TransformationMode mipmapFilterFor(int textureType, const QCommandLineParser& parser) {
+	if (parser.isSet("nearest"))	return Qt::FastTransformation;
+	if (parser.isSet("bilinear"))	return Qt::SmoothTransformation;
+	return isPaletted(textureType) ? Qt::FastTransformation : Qt::SmoothTransformation;
+}
+
+// The formats -format auto picks from, with the flags of 'textureType'. If
+// that is compressed, only compressed formats are tried. Bumpmaps are never
+// picked, since they're not images.
+static QVector<Candidate> autoCandidates(int textureType, const QHash<QString, int>& supportedFormats, const QCommandLineParser& parser) {
+	QVector<Candidate> candidates;
+	QStringList names = supportedFormats.keys();
+	names.sort();
+
+	foreach (const QString& name, names) {
+		const int pixelFormat = supportedFormats.value(name);
+		if (pixelFormat == PIXELFORMAT_BUMPMAP)
+			continue;
+
+		for (int compress=0; compress<2; compress++) {
+			if (!compress && (textureType & FLAG_COMPRESSED))
+				continue;
+			if ((textureType & FLAG_STRIDED) && (compress || pixelFormat >= PIXELFORMAT_PAL4BPP))
+				continue;
+
+			Candidate candidate;
+			candidate.name = compress ? (name + ":vq") : name;
+			candidate.textureType = (pixelFormat << PIXELFORMAT_SHIFT);
+			candidate.textureType |= (textureType & (FLAG_MIPMAPPED | FLAG_STRIDED | FLAG_NONTWIDDLED));
+			candidate.textureType |= compress ? FLAG_COMPRESSED : 0;
+			candidate.expectedSize = 0;
+			candidate.images = nullptr;
+			candidate.colors = nullptr;
+			candidate.psnr = -1.0;
+			candidates.push_back(candidate);
+		}
+	}
+
+	return candidates;
+}
+
+static bool writeTexture(OutputTexture& output, const VQSettings& vqSettings) {
+	if (output.encoded.texture.isEmpty()) {
+		EncodeOptions options;
+		options.textureType = output.textureType;
+		options.vqSettings = vqSettings;
+		options.colors = output.colors;
+		if (!encode(*output.images, options, output.encoded))
+			return false;
+	}
+
+	QFile out(output.filename);
+	if (!out.open(QIODevice::WriteOnly)) {
+		qCritical() << "Failed to open" << output.filename;
+		return false;
+	}
+	out.write(output.lz ? lzPackTexture(output.encoded.texture) : output.encoded.texture);
+	out.close();
+	qDebug() << "Saved texture" << output.filename;
+
+	// The palette is finished now, so save it.
+	if (isPaletted(output.textureType))
+		output.encoded.palette.save(output.paletteFilename);
+
+
+
+	// Generate preview and/or vq code usage images
+	const QString& previewFilename = output.previewFilename;
+	const QString& codeUsageFilename = output.codeUsageFilename;
+	if (!previewFilename.isEmpty() || !codeUsageFilename.isEmpty()) {
+		if (generatePreview(output.encoded.texture, output.encoded.palette, previewFilename, codeUsageFilename)) {
+			if (!previewFilename.isEmpty())		qDebug() << "Saved preview image" << previewFilename;
+			if (!codeUsageFilename.isEmpty())	qDebug() << "Saved code usage image" << codeUsageFilename;
+		} else {
+			if (!previewFilename.isEmpty())		qDebug() << "Failed to save" << previewFilename;
+			if (!codeUsageFilename.isEmpty())	qDebug() << "Failed to save" << codeUsageFilename;
+		}
+	}
+
+	return true;
+}
+
+// Reads the vector quantizer settings from the command line.
+static bool parseVQSettings(const QCommandLineParser& parser, VQSettings& vqSettings) {
+	QHash<QString, int> supportedInitMethods;
+	supportedInitMethods.insert("split",	VQ_INIT_SPLIT);
+	supportedInitMethods.insert("kmeans++",	VQ_INIT_KMEANSPP);
+	supportedInitMethods.insert("pca",		VQ_INIT_PCA);
+
+	QHash<QString, int> supportedSearchMethods;
+	supportedSearchMethods.insert("exact",	VQ_SEARCH_EXACT);
+	supportedSearchMethods.insert("approx",	VQ_SEARCH_APPROX);
+
+	if (parser.isSet("vq-init")) {
+		vqSettings.init = supportedInitMethods.value(parser.value("vq-init"), -1);
+		if (vqSettings.init == -1) {
+			qCritical() << "Unsupported codebook initialization:" << parser.value("vq-init");
+			return false;
+		}
+	}
+	if (parser.isSet("vq-search")) {
+		vqSettings.search = supportedSearchMethods.value(parser.value("vq-search"), -1);
+		if (vqSettings.search == -1) {
+			qCritical() << "Unsupported search method:" << parser.value("vq-search");
+			return false;
+		}
+	}
+	vqSettings.miniBatch = parser.isSet("vq-minibatch");
+	vqSettings.trainOnTexels = parser.isSet("vq-texels");
+	if (parser.isSet("vq-seed")) {
+		bool ok = false;
+		vqSettings.seed = parser.value("vq-seed").toUInt(&ok);
+		if (!ok) {
+			qCritical() << "Invalid seed:" << parser.value("vq-seed");
+			return false;
+		}
+	}
+	if (parser.isSet("vq-starts")) {
+		bool ok = false;
+		vqSettings.starts = parser.value("vq-starts").toInt(&ok);
+		if (!ok || vqSettings.starts < 1) {
+			qCritical() << "Invalid number of starts:" << parser.value("vq-starts");
+			return false;
+		}
+	}
+	if (parser.isSet("vq-codes")) {
+		vqSettings.trimCodebook = true;
+		if (parser.value("vq-codes") != "auto") {
+			bool ok = false;
+			vqSettings.codes = parser.value("vq-codes").toInt(&ok);
+			if (!ok || vqSettings.codes < VQ_CODES_STEP || vqSettings.codes > VQ_CODES_MAX) {
+				qCritical() << "Invalid number of codes:" << parser.value("vq-codes");
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+// Sets up the command line options. -serve jobs use the same ones.
+static void addOptions(QCommandLineParser& parser, const QString& description) {
+	parser.addHelpOption();
+	parser.setApplicationDescription(description);
+	parser.addOption(QCommandLineOption(QStringList() << "i" << "in", "Input file(s). (REQUIRED)", "filename"));
+	parser.addOption(QCommandLineOption(QStringList() << "o" << "out", "Output file(s). (REQUIRED)", "filename"));
+	parser.addOption(QCommandLineOption(QStringList() << "f" << "format", "Texture format for each output file, or auto. Add :vq to only compress that one. (REQUIRED)", "format"));
+	parser.addOption(QCommandLineOption(QStringList() << "m" << "mipmap", "Generate/allow mipmaps."));
+	parser.addOption(QCommandLineOption(QStringList() << "c" << "compress", "Output a compressed texture."));
+	parser.addOption(QCommandLineOption(QStringList() << "s" << "stride", "Output a stride texture."));
+	parser.addOption(QCommandLineOption(QStringList() << "p" << "preview", "Generate a texture preview.", "filename"));
+	parser.addOption(QCommandLineOption(QStringList() << "v" << "verbose", "Extra printouts."));
+	parser.addOption(QCommandLineOption(QStringList() << "n" << "nearest", "Use nearest-neighbor filtering for scaling mipmaps."));
+	parser.addOption(QCommandLineOption(QStringList() << "b" << "bilinear", "Use bilinear filtering for scaling mipmaps."));
+	parser.addOption(QCommandLineOption("vqcodeusage", "Output an image that visualizes compression code usage.", "filename"));
+	parser.addOption(QCommandLineOption("vq-init", "Codebook initialization for compression and color reduction: split (default), kmeans++ or pca.", "method"));
+	parser.addOption(QCommandLineOption("vq-seed", "Random seed for the randomized vector quantization settings.", "seed"));
+	parser.addOption(QCommandLineOption("vq-search", "Nearest code search for compression and color reduction: exact (default) or approx.", "method"));
+	parser.addOption(QCommandLineOption("vq-starts", "Train this many differently seeded codebooks in parallel and keep the best one.", "count"));
+	parser.addOption(QCommandLineOption("vq-minibatch", "Build the initial codebook from a random sample of the input. Faster for large textures."));
+	parser.addOption(QCommandLineOption("vq-texels", "Train compressed YUV422 and BUMPMAP textures on the stored texel values instead of on RGB."));
+	parser.addOption(QCommandLineOption("min-psnr", "Lowest PSNR allowed for -format auto.", "dB"));
+	parser.addOption(QCommandLineOption("vq-codes", "Use at most this many codes (8-256) for compressed textures, or auto, and only store the ones that are used.", "count"));
+	parser.addOption(QCommandLineOption("plan", "Plan formats for all input images so they fit in -budget, and write texconv arguments for them to a file.", "filename"));
+	parser.addOption(QCommandLineOption("budget", "VRAM budget in bytes for -plan. Can end with K or M.", "bytes"));
+	parser.addOption(QCommandLineOption("atlas", "Pack all input images into one texture, and save where each one ended up to a UV table file.", "filename"));
+	parser.addOption(QCommandLineOption("atlas-padding", "Pixels of gutter around each image in the atlas. Default is 1.", "pixels"));
+	parser.addOption(QCommandLineOption("serve", "Convert jobs read from stdin, and write the textures to stdout."));
+	parser.addOption(QCommandLineOption("watch", "Convert the images in a directory by -rules, and again whenever they change.", "directory"));
+	parser.addOption(QCommandLineOption("rules", "Patterns and the options to convert matching images with, for -watch.", "filename"));
+	parser.addOption(QCommandLineOption("info", "Print the headers of textures, or of all textures in a directory, and their total size as JSON.", "path"));
+	parser.addOption(QCommandLineOption("pack", "Put the -in textures, or all textures in -in directories, in one archive.", "filename"));
+	parser.addOption(QCommandLineOption("lz", "Store the texture data LZ compressed."));
+	parser.addOption(QCommandLineOption("lz-benchmark", "Print how well the -in textures compress with -lz, and how fast they decompress."));
+	parser.setSingleDashWordOptionMode(QCommandLineParser::ParseAsLongOptions);
+}
+
+// Reads the options of one -serve or -watch job. 'args' are the options
+// for a single texture, without -in and -out.
+static bool parseJob(const QStringList& args, const QHash<QString, int>& supportedFormats, JobSettings& job) {
+	QCommandLineParser parser;
+	addOptions(parser, QString());
+	QStringList arguments = args;
+	arguments.prepend("texconv");
+	if (!parser.parse(arguments)) {
+		qCritical() << parser.errorText();
+		return false;
+	}
+
+	QString format = parser.value("format");
+	const bool compressed = parser.isSet("compress") || format.endsWith(":vq");
+	if (format.endsWith(":vq"))
+		format.chop(3);
+	const int pixelFormat = supportedFormats.value(format, -1);
+	if (pixelFormat == -1) {
+		qCritical() << "Unsupported format:" << parser.value("format");
+		return false;
+	}
+
+	int textureType = (pixelFormat << PIXELFORMAT_SHIFT);
+	textureType |= parser.isSet("mipmap") ? FLAG_MIPMAPPED : 0;
+	textureType |= compressed ? FLAG_COMPRESSED : 0;
+	textureType |= parser.isSet("stride") ? (FLAG_STRIDED | FLAG_NONTWIDDLED) : 0;
+	if (!checkStride(textureType))
+		return false;
+
+	job.options.textureType = textureType;
+	job.mipmapFilter = mipmapFilterFor(textureType, parser);
+	job.lz = parser.isSet("lz");
+	return parseVQSettings(parser, job.options.vqSettings);
+}
+
+// Converts one -serve job. 'sources' are the input images as image files.
+static bool serveJob(const QStringList& args, const QVector<QByteArray>& sources, const QHash<QString, int>& supportedFormats, QByteArray& texture, QByteArray& paletteData) {
+	JobSettings job;
+	if (!parseJob(args, supportedFormats, job))
+		return false;
+
+	QVector<QImage> images;
+	foreach (const QByteArray& source, sources) {
+		QImage img;
+		img.loadFromData(source);
+		images.push_back(img);
+	}
+	ImageContainer container;
+	if (!container.load(images, "job", job.options.textureType, job.mipmapFilter))
+		return false;
+
+	EncodedTexture encoded;
+	if (!encode(container, job.options, encoded))
+		return false;
+	texture = job.lz ? lzPackTexture(encoded.texture) : encoded.texture;
+	paletteData = encoded.paletteData;
+	return true;
+}
+
+// Reads a 'size' byte part of a -serve request into 'data'. A part larger
+// than 'maxSize' is skipped instead, and 'valid' is cleared. Returns false
+// if the request ends early or the size is negative, since there's no way
+// to find the next request then.
+static bool readServeData(QDataStream& input, qint32 size, qint32 maxSize, QByteArray& data, bool& valid) {
+	data.clear();
+	if (size < 0 || input.status() != QDataStream::Ok)
+		return false;
+	if (size > maxSize) {
+		valid = false;
+		return input.skipRawData(size) == size;
+	}
+	data.resize(size);
+	return input.readRawData(data.data(), size) == size;
+}
+
+// -serve: converts jobs read from stdin until it's closed, and writes the
+// results to stdout. The process, its thread pool and the twiddle tables
+// stay around between jobs. See the readme for the frame layouts.
+static int serveMode(const QHash<QString, int>& supportedFormats) {
+#ifdef Q_OS_WIN32
+	// The frames are binary
+	_setmode(_fileno(stdin), _O_BINARY);
+	_setmode(_fileno(stdout), _O_BINARY);
+#endif
+	QFile in;
+	QFile out;
+	in.open(stdin, QIODevice::ReadOnly | QIODevice::Unbuffered);
+	out.open(stdout, QIODevice::WriteOnly | QIODevice::Unbuffered);
+	QDataStream input(&in);
+	QDataStream output(&out);
+	input.setByteOrder(QDataStream::LittleEndian);
+	output.setByteOrder(QDataStream::LittleEndian);
+
+	while (true) {
+		char magic[4];
+		if (input.readRawData(magic, 4) != 4)
+			return 0;
+		if (memcmp(magic, SERVE_REQUEST_MAGIC, 4) != 0) {
+			qCritical("Invalid request");
+			return -1;
+		}
+
+		qint32 argsSize = 0;
+		qint32 imageCount = 0;
+		input >> argsSize >> imageCount;
+
+		// Too large requests are still read to the end, so the next one can
+		// be served
+		bool valid = (imageCount <= SERVE_MAX_IMAGES);
+		QByteArray args;
+		bool complete = (imageCount >= 0) && readServeData(input, argsSize, SERVE_MAX_ARGS_SIZE, args, valid);
+		QVector<QByteArray> sources;
+		for (int i=0; i<imageCount && complete; i++) {
+			qint32 size = 0;
+			input >> size;
+			QByteArray source;
+			complete = readServeData(input, size, SERVE_MAX_IMAGE_SIZE, source, valid);
+			if (valid)
+				sources.push_back(source);
+		}
+
+		QByteArray texture;
+		QByteArray palette;
+		bool ok = false;
+		if (!complete) {
+			qCritical("Truncated or invalid request");
+		} else if (!valid) {
+			qCritical("Request too large, at most %d images of %d bytes and %d bytes of options are allowed", SERVE_MAX_IMAGES, SERVE_MAX_IMAGE_SIZE, SERVE_MAX_ARGS_SIZE);
+		} else {
+			// One option per line, empty lines are allowed
+			QStringList options = QString::fromUtf8(args).split('\n');
+			options.removeAll(QString());
+			ok = serveJob(options, sources, supportedFormats, texture, palette);
+		}
+		if (!ok) {
+			texture.clear();
+			palette.clear();
+		}
+
+		output.writeRawData(SERVE_RESPONSE_MAGIC, 4);
+		output << (qint32)(ok ? 0 : -1);
+		output << (qint32)texture.size();
+		output << (qint32)palette.size();
+		output.writeRawData(texture.constData(), texture.size());
+		output.writeRawData(palette.constData(), palette.size());
+		out.flush();
+
+		if (!complete)
+			return -1;
+	}
+}
+
+// Reads a -watch rules file. Each line is a wildcard pattern followed by
+// the options to convert matching files with. Empty lines and lines starting
+// with # are skipped.
+static bool loadRules(const QString& filename, const QHash<QString, int>& supportedFormats, QVector<WatchRule>& rules) {
+	QFile file(filename);
+	if (!file.open(QIODevice::ReadOnly)) {
+		qCritical() << "Failed to open" << filename;
+		return false;
+	}
+
+	QTextStream in(&file);
+	rules.clear();
+	for (int line=1; !in.atEnd(); line++) {
+		const QString text = in.readLine().simplified();
+		if (text.isEmpty() || text.startsWith('#'))
+			continue;
+
+		WatchRule rule;
+		rule.args = text.split(' ');
+		rule.pattern = rule.args.takeFirst();
+		if (!parseJob(rule.args, supportedFormats, rule.job)) {
+			qCritical("Invalid rule on line %d of %s", line, qPrintable(filename));
+			return false;
+		}
+		rules.push_back(rule);
+	}
+
+	qDebug() << "Loaded" << rules.size() << "rules from" << filename;
+	return true;
+}
+
+// -watch writes the texture next to the source image
+static QString watchOutputFilename(const QString& filename) {
+	const QFileInfo info(filename);
+	return QDir(info.path()).filePath(info.completeBaseName() + ".tex");
+}
+
+// Converts a file for -watch. The loaded images and their mipmaps are kept,
+// so they don't have to be loaded again if only the rules change.
+static void watchConvert(WatchState& state, const QString& filename, const JobSettings& job) {
+	const QFileInfo info(filename);
+	const qint64 modified = info.lastModified().toMSecsSinceEpoch();
+	const qint64 size = info.size();
+	const int flags = job.options.textureType & (FLAG_MIPMAPPED | FLAG_STRIDED);
+
+	// A file only has one rule, so only the images loaded for the latest
+	// one are kept
+	QSharedPointer<CachedImages> cached;
+	{
+		QMutexLocker locker(&state.mutex);
+		cached = state.cache.value(filename);
+	}
+	if (cached.isNull() || cached->modified != modified || cached->size != size || cached->flags != flags || cached->mipmapFilter != job.mipmapFilter) {
+		cached = QSharedPointer<CachedImages>(new CachedImages);
+		cached->modified = modified;
+		cached->size = size;
+		cached->flags = flags;
+		cached->mipmapFilter = job.mipmapFilter;
+		if (!cached->images.load(QStringList() << filename, job.options.textureType, job.mipmapFilter))
+			return;
+		QMutexLocker locker(&state.mutex);
+		state.cache.insert(filename, cached);
+	}
+
+	EncodedTexture encoded;
+	if (!encode(cached->images, job.options, encoded))
+		return;
+
+	const QString textureFilename = watchOutputFilename(filename);
+	QFile out(textureFilename);
+	if (!out.open(QIODevice::WriteOnly)) {
+		qCritical() << "Failed to open" << textureFilename;
+		return;
+	}
+	out.write(job.lz ? lzPackTexture(encoded.texture) : encoded.texture);
+	out.close();
+	qDebug() << "Saved texture" << textureFilename;
+
+	if (isPaletted(encoded.textureType)) {
+		QFile pal(textureFilename + ".pal");
+		if (!pal.open(QIODevice::WriteOnly)) {
+			qCritical() << "Failed to open" << pal.fileName();
+			return;
+		}
+		pal.write(encoded.paletteData);
+		pal.close();
+	}
+}
+
+// Starts converting a file on the thread pool. If it's already being
+// converted, it's converted again when that's done.
+static void watchStart(WatchState& state, const QString& filename, const JobSettings& job) {
+	QMutexLocker locker(&state.mutex);
+	if (state.running.contains(filename)) {
+		state.rerun.insert(filename, job);
+		return;
+	}
+	state.running.insert(filename);
+
+	QtConcurrent::run([&state, filename, job]() {
+		JobSettings next = job;
+		while (true) {
+			watchConvert(state, filename, next);
+
+			QMutexLocker locker(&state.mutex);
+			if (!state.rerun.contains(filename)) {
+				state.running.remove(filename);
+				return;
+			}
+			next = state.rerun.take(filename);
+		}
+	});
+}
+
+// Goes through the watched directory, watches new files and directories, and
+// converts the files that changed or that have a different rule now. At
+// startup, files with a texture newer than them and the rules are skipped.
+static void watchScan(WatchState& state, QFileSystemWatcher& watcher, bool startup) {
+	// Saving by renaming drops the old file from the watcher, so check
+	// what's still there.
+	QSet<QString> watched;
+	foreach (const QString& path, watcher.files() + watcher.directories())
+		watched.insert(path);
+	if (!watched.contains(state.dir))
+		watcher.addPath(state.dir);
+
+	const QDir dir(state.dir);
+	const QFileInfo rulesInfo(state.rulesFilename);
+	QSet<QString> seen;
+	QDirIterator it(state.dir, QDir::Dirs | QDir::Files | QDir::NoDotAndDotDot, QDirIterator::Subdirectories);
+	while (it.hasNext()) {
+		const QString filename = it.next();
+		const QFileInfo info = it.fileInfo();
+		if (info.isDir()) {
+			if (!watched.contains(filename))
+				watcher.addPath(filename);
+			continue;
+		}
+
+		// Skip the textures written here, in case a pattern matches them
+		if (filename.endsWith(".tex") || filename.endsWith(".tex.pal"))
+			continue;
+
+		// The first rule that matches is used
+		const QString relative = dir.relativeFilePath(filename);
+		const WatchRule* rule = nullptr;
+		for (int i=0; i<state.rules.size() && !rule; i++) {
+			if (QDir::match(state.rules[i].pattern, relative))
+				rule = &state.rules[i];
+		}
+		if (!rule)
+			continue;
+
+		// Directories only tell about files coming and going, not changing
+		if (!watched.contains(filename))
+			watcher.addPath(filename);
+		seen.insert(filename);
+
+		WatchSource source;
+		source.modified = info.lastModified().toMSecsSinceEpoch();
+		source.size = info.size();
+		source.args = rule->args;
+
+		bool convert;
+		if (startup) {
+			const QFileInfo texture(watchOutputFilename(filename));
+			convert = !texture.exists() || texture.lastModified() < info.lastModified() || texture.lastModified() < rulesInfo.lastModified();
+		} else if (state.sources.contains(filename)) {
+			const WatchSource& old = state.sources[filename];
+			convert = (old.modified != source.modified || old.size != source.size || old.args != source.args);
+		} else {
+			convert = true;
+		}
+
+		state.sources.insert(filename, source);
+		if (convert)
+			watchStart(state, filename, rule->job);
+	}
+
+	// Forget files that are gone, and no longer match a rule
+	QMutexLocker locker(&state.mutex);
+	foreach (const QString& filename, state.sources.keys()) {
+		if (!seen.contains(filename)) {
+			state.sources.remove(filename);
+			state.cache.remove(filename);
+		}
+	}
+}
+
+// -watch: converts the files in a directory that match the -rules, and
+// converts them again whenever they change. Runs until it's killed.
+static int watchMode(const QCommandLineParser& parser, const QHash<QString, int>& supportedFormats) {
+	WatchState state;
+	state.dir = parser.value("watch");
+	state.rulesFilename = parser.value("rules");
+	if (!QFileInfo(state.dir).isDir()) {
+		qCritical() << "Not a directory:" << state.dir;
+		return -1;
+	}
+	if (!loadRules(state.rulesFilename, supportedFormats, state.rules))
+		return -1;
+
+	QFileSystemWatcher watcher;
+	watcher.addPath(state.rulesFilename);
+	watchScan(state, watcher, true);
+
+	// Editors often save a file in several steps, so wait for the changes
+	// to stop before looking at them.
+	bool rulesChanged = false;
+	QTimer debounce;
+	debounce.setSingleShot(true);
+	debounce.setInterval(WATCH_DEBOUNCE_MS);
+	QObject::connect(&debounce, &QTimer::timeout, [&]() {
+		if (rulesChanged) {
+			rulesChanged = false;
+			if (!watcher.files().contains(state.rulesFilename))
+				watcher.addPath(state.rulesFilename);
+			QVector<WatchRule> rules;
+			if (loadRules(state.rulesFilename, supportedFormats, rules))
+				state.rules = rules;
+			else
+				qWarning("Keeping the old rules");
+		}
+		watchScan(state, watcher, false);
+	});
+	QObject::connect(&watcher, &QFileSystemWatcher::fileChanged, [&](const QString& path) {
+		if (path == state.rulesFilename)
+			rulesChanged = true;
+		debounce.start();
+	});
+	QObject::connect(&watcher, &QFileSystemWatcher::directoryChanged, [&](const QString&) {
+		debounce.start();
+	});
+
+	qDebug() << "Watching" << state.dir;
+	return QCoreApplication::exec();
+}
+
+// The -info totals for one combination of format and flags
+struct InfoGroup {
+	InfoGroup() : mipmapped(false), compressed(false), count(0), size(0) {}
+
+	QString	format;
+	bool	mipmapped;
+	bool	compressed;
+	int		count;
+	qint64	size;
+};
+
+static QString formatName(int textureType, const QHash<QString, int>& supportedFormats) {
+	const int pixelFormat = (textureType >> PIXELFORMAT_SHIFT) & PIXELFORMAT_MASK;
+	return supportedFormats.key(pixelFormat, "UNKNOWN");
+}
+
+// -info: prints what the headers of a lot of texture files say, and how much
+// VRAM they add up to, as JSON to stdout.
+static int infoMode(const QCommandLineParser& parser, const QHash<QString, int>& supportedFormats) {
+	QStringList filenames;
+	QStringList names;
+	findTextures(parser.values("info"), filenames, names);
+	QVector<TextureInfo> infos;
+	inspectTextures(filenames, infos);
+
+	QJsonArray textures;
+	QMap<QString, InfoGroup> groups;	// Sorted by format and flags
+	int invalid = 0;
+	qint64 totalSize = 0;
+	foreach (const TextureInfo& info, infos) {
+		QJsonObject texture;
+		texture["file"] = info.filename;
+		if (!info.archive.isEmpty())
+			texture["archive"] = info.archive;
+		if (!info.error.isEmpty()) {
+			texture["error"] = info.error;
+			textures.append(texture);
+			invalid++;
+			continue;
+		}
+
+		const int textureType = info.header.textureType;
+		const QString format = formatName(textureType, supportedFormats);
+		const bool mipmapped = (textureType & FLAG_MIPMAPPED);
+		const bool compressed = (textureType & FLAG_COMPRESSED);
+		texture["width"] = info.header.width;
+		texture["height"] = info.header.height;
+		texture["format"] = format;
+		texture["mipmapped"] = mipmapped;
+		texture["compressed"] = compressed;
+		texture["twiddled"] = !(textureType & FLAG_NONTWIDDLED);
+		texture["strided"] = bool(textureType & FLAG_STRIDED);
+		texture["size"] = info.header.size;
+		if (info.lz) {
+			texture["lz"] = true;
+			texture["stored"] = double(info.fileSize);
+		}
+		if (compressed)
+			texture["codes"] = codebookSize(textureType);
+		if (info.paletteColors >= 0)
+			texture["colors"] = info.paletteColors;
+		textures.append(texture);
+
+		InfoGroup& group = groups[format + (compressed ? ":vq" : "") + (mipmapped ? ":mm" : "")];
+		group.format = format;
+		group.mipmapped = mipmapped;
+		group.compressed = compressed;
+		group.count++;
+		group.size += info.header.size;
+		totalSize += info.header.size;
+	}
+
+	QJsonArray groupArray;
+	foreach (const InfoGroup& group, groups) {
+		QJsonObject object;
+		object["format"] = group.format;
+		object["mipmapped"] = group.mipmapped;
+		object["compressed"] = group.compressed;
+		object["count"] = group.count;
+		object["size"] = double(group.size);
+		groupArray.append(object);
+	}
+
+	QJsonObject totals;
+	totals["files"] = infos.size();
+	totals["valid"] = infos.size() - invalid;
+	totals["invalid"] = invalid;
+	totals["size"] = double(totalSize);
+	totals["groups"] = groupArray;
+
+	QJsonObject root;
+	root["textures"] = textures;
+	root["totals"] = totals;
+
+	QFile out;
+	out.open(stdout, QIODevice::WriteOnly);
+	out.write(QJsonDocument(root).toJson());
+	out.close();
+
+	qDebug() << infos.size() << "files," << invalid << "invalid";
+	return (invalid > 0) ? -1 : 0;
+}
+
+// -pack: puts the textures in the -in files and directories, and their
+// palettes, in one archive. Textures in -in archives are packed again.
+static int packMode(const QCommandLineParser& parser) {
+	QStringList filenames;
+	QStringList names;
+	findTextures(parser.values("in"), filenames, names);
+	QHash<QString, QString> nameOf;
+	for (int i=0; i<filenames.size(); i++)
+		nameOf.insert(filenames[i], names[i]);
+
+	// Don't pack anything that isn't a valid texture
+	QVector<TextureInfo> infos;
+	inspectTextures(filenames, infos);
+	bool ok = true;
+	foreach (const TextureInfo& info, infos) {
+		if (!info.error.isEmpty()) {
+			qCritical() << (info.archive.isEmpty() ? info.filename : (info.archive + ":" + info.filename)) << info.error;
+			ok = false;
+		}
+	}
+	if (!ok)
+		return -1;
+
+	QHash<QString, QSharedPointer<TextureArchive> > archives;
+	QVector<ArchiveEntry> entries;
+	foreach (const TextureInfo& info, infos) {
+		ArchiveEntry entry;
+		if (info.archive.isEmpty()) {
+			entry.name = nameOf.value(info.filename);
+			if (!loadTexture(info.filename, entry.texture, entry.palette))
+				return -1;
+		} else {
+			// The entries point into the archive, so keep it open
+			QSharedPointer<TextureArchive>& archive = archives[info.archive];
+			if (!archive) {
+				archive = QSharedPointer<TextureArchive>(new TextureArchive);
+				if (!archive->open(info.archive))
+					return -1;
+			}
+			entry = archive->entry(archive->find(info.filename));
+		}
+		if (!isPaletted(info.header.textureType))
+			entry.palette.clear();
+		entries.push_back(entry);
+	}
+
+	if (!writeArchive(parser.value("pack"), entries))
+		return -1;
+	return 0;
+}
+
+// -preview without -out: makes previews of the -in textures, which can be
+// in archives, instead of converting images.
+static int previewMode(const QCommandLineParser& parser, const QStringList& srcFilenames) {
+	const QStringList previewFilenames = parser.values("preview");
+	const QStringList codeUsageFilenames = parser.values("vqcodeusage");
+	if (previewFilenames.size() > srcFilenames.size() || codeUsageFilenames.size() > srcFilenames.size()) {
+		qCritical("There are more preview or code usage images than input textures");
+		return -1;
+	}
+
+	for (int i=0; i<qMax(previewFilenames.size(), codeUsageFilenames.size()); i++) {
+		QByteArray texture;
+		QByteArray paletteData;
+		if (!loadTexture(srcFilenames[i], texture, paletteData))
+			return -1;
+
+		Palette palette;
+		if (!paletteData.isEmpty()) {
+			QDataStream stream(paletteData);
+			if (!palette.load(stream)) {
+				qCritical() << "The palette of" << srcFilenames[i] << "isn't valid";
+				return -1;
+			}
+		}
+
+		if (!generatePreview(texture, palette, previewFilenames.value(i), codeUsageFilenames.value(i))) {
+			qCritical() << "Failed to generate a preview of" << srcFilenames[i];
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// The -lz-benchmark results for one format
+struct LZStats {
+	LZStats() : count(0), size(0), compressedSize(0), seconds(0) {}
+
+	int		count;
+	qint64	size;
+	qint64	compressedSize;
+	double	seconds;	// Spent decompressing 'size' bytes once
+};
+
+static QString lzStatsLine(const QString& name, const LZStats& stats) {
+	return QString("%1 %2 %3 %4 %5% %6")
+		.arg(name, -16)
+		.arg(stats.count, 8)
+		.arg(stats.size, 12)
+		.arg(stats.compressedSize, 12)
+		.arg(stats.size ? (100.0 * stats.compressedSize / stats.size) : 100.0, 6, 'f', 1)
+		.arg(stats.seconds > 0 ? (stats.size / stats.seconds / (1024 * 1024)) : 0.0, 11, 'f', 1);
+}
+
+// -lz-benchmark: prints how much -lz would shrink the texture data of the -in
+// textures, and how fast it decompresses, for each format
+static int lzBenchmarkMode(const QCommandLineParser& parser, const QHash<QString, int>& supportedFormats) {
+	QStringList filenames;
+	QStringList names;
+	findTextures(parser.values("in"), filenames, names);
+	QVector<TextureInfo> infos;
+	inspectTextures(filenames, infos);
+
+	QMap<QString, LZStats> formats;
+	foreach (const TextureInfo& info, infos) {
+		const QString filename = info.archive.isEmpty() ? info.filename : (info.archive + ":" + info.filename);
+		if (!info.error.isEmpty()) {
+			qWarning() << "Skipping" << filename << info.error;
+			continue;
+		}
+		QByteArray texture;
+		QByteArray palette;
+		if (!loadTexture(filename, texture, palette))
+			continue;
+
+		const QByteArray data = texture.mid(16);
+		const QByteArray compressed = lzCompress(data);
+		QByteArray decompressed(data.size(), 0);
+		const int runs = qMax(1, LZ_BENCHMARK_BYTES / qMax(data.size(), 1));
+		bool ok = true;
+		QElapsedTimer timer;
+		timer.start();
+		for (int i=0; i<runs; i++)
+			ok &= lzDecompress((const uchar*)compressed.constData(), compressed.size(), (uchar*)decompressed.data(), decompressed.size());
+		const double seconds = timer.nsecsElapsed() * 1e-9 / runs;
+		if (!ok || decompressed != data) {
+			qCritical() << "Decompressing" << filename << "didn't give back the same data";
+			return -1;
+		}
+
+		const QString format = formatName(info.header.textureType, supportedFormats) + ((info.header.textureType & FLAG_COMPRESSED) ? ":vq" : "");
+		LZStats& stats = formats[format];
+		stats.count++;
+		stats.size += data.size();
+		stats.compressedSize += compressed.size();
+		stats.seconds += seconds;
+	}
+
+	LZStats total;
+	foreach (const LZStats& stats, formats) {
+		total.count += stats.count;
+		total.size += stats.size;
+		total.compressedSize += stats.compressedSize;
+		total.seconds += stats.seconds;
+	}
+
+	QTextStream out(stdout);
+	out << QString("%1 %2 %3 %4 %5 %6").arg("format", -16).arg("textures", 8).arg("bytes", 12).arg("lz bytes", 12).arg("ratio", 7).arg("decode MB/s", 11) << "\n";
+	for (QMap<QString, LZStats>::const_iterator it = formats.constBegin(); it != formats.constEnd(); ++it)
+		out << lzStatsLine(it.key(), it.value()) << "\n";
+	out << lzStatsLine("total", total) << "\n";
+	return 0;
+}
+
+// The options that -plan passes on to every texture in the plan, so they're
+// converted with the same settings they were planned with.
+static QString planArguments(const QCommandLineParser& parser) {
+	const QStringList flags = QStringList() << "nearest" << "bilinear" << "vq-minibatch" << "vq-texels";
+	const QStringList options = QStringList() << "vq-init" << "vq-seed" << "vq-search" << "vq-starts" << "vq-codes";
+
+	QStringList arguments;
+	foreach (const QString& name, flags) {
+		if (parser.isSet(name))
+			arguments << ("-" + name);
+	}
+	foreach (const QString& name, options) {
+		if (parser.isSet(name))
+			arguments << ("-" + name) << parser.value(name);
+	}
+	return arguments.join(" ");
+}
+
+// -plan: picks a format for every input image so they all fit in -budget.
+// The choices are the -format values, or all formats but BUMPMAP, both
+// compressed and uncompressed.
+static int planMode(const QCommandLineParser& parser, const QStringList& srcFilenames, const QHash<QString, int>& supportedFormats) {
+	if (parser.isSet("stride")) {
+		qCritical("Stride textures can't be planned");
+		return -1;
+	}
+
+	// The budget can be given in kilobytes or megabytes
+	QString budgetValue = parser.value("budget");
+	qint64 multiplier = 1;
+	if (budgetValue.endsWith("K", Qt::CaseInsensitive)) {
+		multiplier = 1024;
+		budgetValue.chop(1);
+	} else if (budgetValue.endsWith("M", Qt::CaseInsensitive)) {
+		multiplier = 1024 * 1024;
+		budgetValue.chop(1);
+	}
+	bool ok = false;
+	const qint64 budget = budgetValue.toLongLong(&ok) * multiplier;
+	if (!ok || budget <= 0) {
+		qCritical() << "Invalid budget:" << parser.value("budget");
+		return -1;
+	}
+
+	QStringList formats = parser.values("format");
+	if (formats.isEmpty()) {
+		QStringList names = supportedFormats.keys();
+		names.sort();
+		foreach (const QString& name, names) {
+			if (supportedFormats.value(name) == PIXELFORMAT_BUMPMAP)
+				continue;
+			formats << name << (name + ":vq");
+		}
+	}
+
+	QVector<int> textureTypes;
+	QStringList formatNames;
+	foreach (QString format, formats) {
+		const bool compressed = parser.isSet("compress") || format.endsWith(":vq");
+		if (format.endsWith(":vq"))
+			format.chop(3);
+
+		const int pixelFormat = supportedFormats.value(format, -1);
+		if (pixelFormat == -1 || pixelFormat == PIXELFORMAT_BUMPMAP) {
+			qCritical() << "Unsupported format for -plan:" << format;
+			return -1;
+		}
+
+		int textureType = (pixelFormat << PIXELFORMAT_SHIFT);
+		textureType |= parser.isSet("mipmap") ? FLAG_MIPMAPPED : 0;
+		textureType |= compressed ? FLAG_COMPRESSED : 0;
+		if (textureTypes.contains(textureType))
+			continue;
+		textureTypes.push_back(textureType);
+		formatNames.push_back(compressed ? (format + ":vq") : format);
+	}
+
+	VQSettings vqSettings;
+	if (!parseVQSettings(parser, vqSettings))
+		return -1;
+
+	if (!planTextures(srcFilenames, textureTypes, formatNames, budget, parser.value("plan"), vqSettings, planArguments(parser)))
+		return -1;
+	return 0;
+}
+
 int main(int argc, char** argv) {
 	qInstallMessageHandler(messageHandler);
 
@@ -76,25 +1208,33 @@ int main(int argc, char** argv) {
 
 	QCoreApplication app(argc, argv);
 	QCommandLineParser parser;
-	parser.addHelpOption();
-	parser.setApplicationDescription(description);
-	parser.addOption(QCommandLineOption(QStringList() << "i" << "in", "Input file(s). (REQUIRED)", "filename"));
-	parser.addOption(QCommandLineOption(QStringList() << "o" << "out", "Output file. (REQUIRED)", "filename"));
-	parser.addOption(QCommandLineOption(QStringList() << "f" << "format", "Texture format. (REQUIRED)", "format"));
-	parser.addOption(QCommandLineOption(QStringList() << "m" << "mipmap", "Generate/allow mipmaps."));
-	parser.addOption(QCommandLineOption(QStringList() << "c" << "compress", "Output a compressed texture."));
-	parser.addOption(QCommandLineOption(QStringList() << "s" << "stride", "Output a stride texture."));
-	parser.addOption(QCommandLineOption(QStringList() << "p" << "preview", "Generate a texture preview.", "filename"));
-	parser.addOption(QCommandLineOption(QStringList() << "v" << "verbose", "Extra printouts."));
-	parser.addOption(QCommandLineOption(QStringList() << "n" << "nearest", "Use nearest-neighbor filtering for scaling mipmaps."));
-	parser.addOption(QCommandLineOption(QStringList() << "b" << "bilinear", "Use bilinear filtering for scaling mipmaps."));
-	parser.addOption(QCommandLineOption("vqcodeusage", "Output an image that visualizes compression code usage.", "filename"));
-	parser.setSingleDashWordOptionMode(QCommandLineParser::ParseAsLongOptions);
+	addOptions(parser, description);
 	parser.process(app);
 
 	// This is needed early for printouts
 	g_verbose = parser.isSet("verbose");
 
+	// Jobs come from stdin instead of the command line
+	if (parser.isSet("serve")) {
+		g_stdoutTaken = true;
+		return serveMode(supportedFormats);
+	}
+
+	// Only looks at existing textures
+	if (parser.isSet("info")) {
+		g_stdoutTaken = true;
+		return infoMode(parser, supportedFormats);
+	}
+
+	// Files are picked up from a directory as they change
+	if (parser.isSet("watch")) {
+		if (!parser.isSet("rules")) {
+			qCritical("-watch needs -rules");
+			return -1;
+		}
+		return watchMode(parser, supportedFormats);
+	}
+
 	// Grab the list of input filenames
 	const QStringList srcFilenames = parser.values("in");
 	if (srcFilenames.isEmpty()) {
@@ -103,120 +1243,238 @@ int main(int argc, char** argv) {
 		return -1;
 	}
 
-	// Grab the output filename
-	const QString dstFilename = parser.value("out");
-	if (dstFilename.isEmpty()) {
+	// Planning works on a whole set of images, each one is a texture
+	if (parser.isSet("plan")) {
+		if (!parser.isSet("budget")) {
+			qCritical("-plan needs -budget");
+			return -1;
+		}
+		return planMode(parser, srcFilenames, supportedFormats);
+	}
+
+	// Packing, benchmarks and previews work on textures that are already
+	// converted
+	if (parser.isSet("pack"))
+		return packMode(parser);
+	if (parser.isSet("lz-benchmark"))
+		return lzBenchmarkMode(parser, supportedFormats);
+	if (!parser.isSet("out") && (parser.isSet("preview") || parser.isSet("vqcodeusage")))
+		return previewMode(parser, srcFilenames);
+
+	// Grab the output filenames and their formats. Several outputs can be
+	// made from the same input in one run, the i:th format goes with the
+	// i:th output file.
+	const QStringList dstFilenames = parser.values("out");
+	if (dstFilenames.isEmpty()) {
 		qCritical("No output file specified");
 		parser.showHelp();
 		return -1;
 	}
-
-	// Calculate palette filename
-	// TODO: Make this an optional argument
-	const QString palFilename = dstFilename + ".pal";
-
-	// Grab the texture format
-	const int pixelFormat = supportedFormats.value(parser.value("format"), -1);
-	if (pixelFormat == -1) {
-		qCritical() << "Unsupported format:" << parser.value("format");
+	const QStringList formats = parser.values("format");
+	if (formats.size() != dstFilenames.size()) {
+		qCritical("Every output file needs a format");
 		parser.showHelp();
 		return -1;
 	}
+	const QStringList previewFilenames = parser.values("preview");
+	const QStringList codeUsageFilenames = parser.values("vqcodeusage");
+	if (previewFilenames.size() > dstFilenames.size() || codeUsageFilenames.size() > dstFilenames.size()) {
+		qCritical("There are more preview or code usage images than output files");
+		return -1;
+	}
 
-	// Now we can start building the type specifier
-	int textureType = (pixelFormat << PIXELFORMAT_SHIFT);
-	textureType |= parser.isSet("mipmap") ? FLAG_MIPMAPPED : 0;
-	textureType |= parser.isSet("compress") ? FLAG_COMPRESSED : 0;
-	textureType |= parser.isSet("stride") ? (FLAG_STRIDED | FLAG_NONTWIDDLED) : 0;
+	QVector<OutputTexture> outputs;
+	for (int i=0; i<dstFilenames.size(); i++) {
+		// A format can be followed by ":vq" to only compress that output
+		QString format = formats[i];
+		const bool compressed = parser.isSet("compress") || format.endsWith(":vq");
+		if (format.endsWith(":vq"))
+			format.chop(3);
 
-	// Determine what mode of filtering we're gonna do for mipmaps.
-	// We're doing nearest-neighbor for paletted images to avoid introducing more colors.
-	// It should probably be done for lossless vq textures as well, but there's no way of
-	// knowing if we're gonna output one of those at this stage, so that's up to the user.
-	Qt::TransformationMode mipmapFilter = isPaletted(textureType) ? Qt::FastTransformation : Qt::SmoothTransformation;
-	if (parser.isSet("nearest"))	mipmapFilter = Qt::FastTransformation;
-	if (parser.isSet("bilinear"))	mipmapFilter = Qt::SmoothTransformation;
-
-	// Stride textures have a lot of restraints, and we need to check 'em all.
-	if (textureType & FLAG_STRIDED) {
-		if (textureType & FLAG_COMPRESSED) {
-			qCritical() << "Stride textures can't be compressed.";
+		// Grab the texture format. 'auto' picks one later, so just use
+		// something that's allowed with all flags until then.
+		const bool autoFormat = (format == "auto");
+		const int pixelFormat = autoFormat ? PIXELFORMAT_RGB565 : supportedFormats.value(format, -1);
+		if (pixelFormat == -1) {
+			qCritical() << "Unsupported format:" << formats[i];
+			parser.showHelp();
 			return -1;
 		}
-		if (!(textureType & FLAG_NONTWIDDLED)) {
-			qCritical() << "Stride textures can't be twiddled.";
-			return -1;
-		}
-		if (textureType & FLAG_MIPMAPPED) {
-			qCritical() << "Stride textures can't have mipmaps.";
-			return -1;
+
+		// Now we can start building the type specifier
+		OutputTexture output;
+		output.filename = dstFilenames[i];
+		output.autoFormat = autoFormat;
+		output.textureType = (pixelFormat << PIXELFORMAT_SHIFT);
+		output.textureType |= parser.isSet("mipmap") ? FLAG_MIPMAPPED : 0;
+		output.textureType |= compressed ? FLAG_COMPRESSED : 0;
+		output.textureType |= parser.isSet("stride") ? (FLAG_STRIDED | FLAG_NONTWIDDLED) : 0;
+
+		// Calculate palette filename
+		// TODO: Make this an optional argument
+		output.paletteFilename = output.filename + ".pal";
+
+		output.previewFilename = previewFilenames.value(i);
+		output.codeUsageFilename = codeUsageFilenames.value(i);
+		if (!output.codeUsageFilename.isEmpty() && !compressed && !autoFormat) {
+			qWarning() << "Not saving" << output.codeUsageFilename << "since" << output.filename << "is not compressed";
+			output.codeUsageFilename = "";
 		}
-		if (isPaletted(textureType) || isFormat(textureType, PIXELFORMAT_BUMPMAP)) {
-			qCritical() << "Only RGB565, ARGB1555, ARGB4444 and YUV422 can be strided.";
+		output.mipmapFilter = Qt::SmoothTransformation;
+		output.images = nullptr;
+		output.colors = nullptr;
+		output.lz = parser.isSet("lz");
+		output.ok = false;
+		outputs.push_back(output);
+	}
+
+	double minPSNR = 0.0;
+	if (parser.isSet("min-psnr")) {
+		bool ok = false;
+		minPSNR = parser.value("min-psnr").toDouble(&ok);
+		if (!ok) {
+			qCritical() << "Invalid PSNR:" << parser.value("min-psnr");
 			return -1;
 		}
+	} else if (formats.contains("auto") || formats.contains("auto:vq")) {
+		qCritical("-format auto needs -min-psnr");
+		return -1;
 	}
 
-	// Time to load the image(s)
-	ImageContainer images;
-	if (!images.load(srcFilenames, textureType, mipmapFilter)) {
+	VQSettings vqSettings;
+	if (!parseVQSettings(parser, vqSettings))
 		return -1;
+
+	for (int i=0; i<outputs.size(); i++) {
+		OutputTexture& output = outputs[i];
+		const int textureType = output.textureType;
+
+		output.mipmapFilter = mipmapFilterFor(textureType, parser);
+
+		if (!checkStride(textureType))
+			return -1;
 	}
 
-	if (textureType & FLAG_STRIDED) {
-		// Now that the image is loaded and its width is known we can put
-		// the stride setting in the texture type field (bits 0-4).
-		const int strideSetting = (images.width() / 32);
-		textureType |= strideSetting;
+	// The formats to try for -format auto
+	QVector<QVector<Candidate>> candidates(outputs.size());
+	for (int i=0; i<outputs.size(); i++) {
+		if (outputs[i].autoFormat)
+			candidates[i] = autoCandidates(outputs[i].textureType, supportedFormats, parser);
 	}
 
+	// Time to load the image(s). The outputs share the loaded images and
+	// their mipmaps, unless they need different mipmap filters. Paletted
+	// outputs also share the colors found in the images.
+	QMap<int, ImageContainer> images;
+	QMap<int, Palette> palettes;
+	QVector<int> textureTypes;
+	for (int i=0; i<outputs.size(); i++) {
+		if (outputs[i].autoFormat) {
+			for (int j=0; j<candidates[i].size(); j++)
+				textureTypes.push_back(candidates[i][j].textureType);
+		} else {
+			textureTypes.push_back(outputs[i].textureType);
+		}
+	}
 
+	// With -atlas, the input images are packed into a single image first.
+	// The atlas has to suit all the outputs.
+	QImage atlas;
+	if (parser.isSet("atlas")) {
+		int padding = 1;
+		if (parser.isSet("atlas-padding")) {
+			bool ok = false;
+			padding = parser.value("atlas-padding").toInt(&ok);
+			if (!ok || padding < 0) {
+				qCritical() << "Invalid atlas padding:" << parser.value("atlas-padding");
+				return -1;
+			}
+		}
 
-	QFile out(dstFilename);
-	if (!out.open(QIODevice::WriteOnly)) {
-		qCritical() << "Failed to open" << dstFilename;
-		return false;
-	}
-	QDataStream stream(&out);
-	stream.setByteOrder(QDataStream::LittleEndian);
+		int atlasType = 0;
+		for (int i=0; i<textureTypes.size(); i++)
+			atlasType |= textureTypes[i] & (FLAG_MIPMAPPED | FLAG_STRIDED | FLAG_COMPRESSED);
 
-	// Write texture header
-	const int expectedSize = writeTextureHeader(stream, images.width(), images.height(), textureType);
-	const int positionBeforeData = (int)stream.device()->pos();
+		QVector<QRect> rects;
+		if (!packAtlas(srcFilenames, atlasType, padding, atlas, rects))
+			return -1;
 
-	// Write texture data
-	if (isPaletted(textureType)) {
-		convertPaletted(stream, images, textureType, palFilename);
-	} else {
-		convert16BPP(stream, images, textureType);
+		// The UV table uses the size from the texture header
+		QSize size = atlas.size();
+		if (atlasType & FLAG_STRIDED)
+			size.setWidth(nextPowerOfTwo(size.width()));
+		if (!saveUVTable(parser.value("atlas"), size, rects))
+			return -1;
+		qDebug() << "Saved UV table" << parser.value("atlas");
 	}
 
-	// Pad the texture data block to 32 bytes
-	const int positionAfterData = (int)stream.device()->pos();
-	const int padding = expectedSize - (positionAfterData - positionBeforeData);
-	if (padding > 0) {
-		if (padding >= 32)
-			qWarning() << "Padding is" << padding << "but it should be less than 32!";
-		writeZeroes(stream, padding);
-		qDebug() << "Added" << padding << "bytes of padding";
+	for (int i=0; i<textureTypes.size(); i++) {
+		const int filter = mipmapFilterFor(textureTypes[i], parser);
+		if (!images.contains(filter)) {
+			const bool loaded = atlas.isNull() ?
+				images[filter].load(srcFilenames, textureTypes[i], (Qt::TransformationMode)filter) :
+				images[filter].load(QVector<QImage>() << atlas, parser.value("atlas"), textureTypes[i], (Qt::TransformationMode)filter);
+			if (!loaded) {
+				return -1;
+			}
+		}
+		if (isPaletted(textureTypes[i]) && !palettes.contains(filter)) {
+			palettes.insert(filter, Palette(images[filter]));
+		}
 	}
 
-	out.close();
-	qDebug() << "Saved texture" << dstFilename;
-
+	for (int i=0; i<outputs.size(); i++) {
+		OutputTexture& output = outputs[i];
 
+		if (output.autoFormat) {
+			for (int j=0; j<candidates[i].size(); j++) {
+				Candidate& candidate = candidates[i][j];
+				const int filter = mipmapFilterFor(candidate.textureType, parser);
+				candidate.images = &images[filter];
+				if (isPaletted(candidate.textureType))
+					candidate.colors = &palettes[filter];
+				if (candidate.textureType & FLAG_STRIDED)
+					candidate.textureType |= (candidate.images->width() / 32);
+				// With -vq-codes the codebook can end up as small as
+				// VQ_CODES_STEP codes, so assume that, or chooseCandidate()
+				// could skip a texture that would have been the smallest.
+				int sizeType = candidate.textureType;
+				if ((sizeType & FLAG_COMPRESSED) && vqSettings.trimCodebook)
+					sizeType |= codebookSetting(VQ_CODES_STEP);
+				candidate.expectedSize = 16 + calculateSize(candidate.images->width(), candidate.images->height(), sizeType);
+			}
 
-	// Generate preview and/or vq code usage images
-	const QString previewFilename = parser.value("preview");
-	const QString codeUsageFilename = (textureType & FLAG_COMPRESSED) ? parser.value("vqcodeusage") : "";
-	if (!previewFilename.isEmpty() || !codeUsageFilename.isEmpty()) {
-		if (generatePreview(dstFilename, palFilename, previewFilename, codeUsageFilename)) {
-			if (!previewFilename.isEmpty())		qDebug() << "Saved preview image" << previewFilename;
-			if (!codeUsageFilename.isEmpty())	qDebug() << "Saved code usage image" << codeUsageFilename;
-		} else {
-			if (!previewFilename.isEmpty())		qDebug() << "Failed to save" << previewFilename;
-			if (!codeUsageFilename.isEmpty())	qDebug() << "Failed to save" << codeUsageFilename;
+			// Convert the candidates and keep the one that was picked
+			const int best = chooseCandidate(candidates[i], minPSNR, vqSettings);
+			if (best == -1) {
+				qCritical() << "No format could be picked for" << output.filename;
+				return -1;
+			}
+			const Candidate& picked = candidates[i][best];
+			qDebug("Picked %s for %s", qPrintable(picked.name), qPrintable(output.filename));
+			output.textureType = picked.textureType;
+			output.mipmapFilter = mipmapFilterFor(picked.textureType, parser);
+			output.encoded = picked.encoded;
+			if (!(output.textureType & FLAG_COMPRESSED) && !output.codeUsageFilename.isEmpty()) {
+				qWarning() << "Not saving" << output.codeUsageFilename << "since" << picked.name << "is not compressed";
+				output.codeUsageFilename = "";
+			}
+			candidates[i].clear();
 		}
+
+		output.images = &images[output.mipmapFilter];
+		if (isPaletted(output.textureType))
+			output.colors = &palettes[output.mipmapFilter];
+	}
+
+	// Convert all outputs at the same time
+	QtConcurrent::blockingMap(outputs, [&vqSettings](OutputTexture& output) {
+		output.ok = writeTexture(output, vqSettings);
+	});
+
+	for (int i=0; i<outputs.size(); i++) {
+		if (!outputs[i].ok)
+			return -1;
 	}
 
     return 0;
@@ -1,5 +1,8 @@
 #include "twiddler.h"
 
+#include <QHash>
+#include <QMutex>
+
 Twiddler::Twiddler(int w, int h) {
 	m_width = w;
 	m_height = h;
@@ -19,6 +22,17 @@ Twiddler::~Twiddler() {
 	delete[] m_index;
 }
 
+const Twiddler& Twiddler::shared(int w, int h) {
+	static QMutex mutex;
+	static QHash<quint64, Twiddler*> twiddlers;
+
+	QMutexLocker locker(&mutex);
+	Twiddler*& twiddler = twiddlers[((quint64)w << 32) | (quint32)h];
+	if (!twiddler)
+		twiddler = new Twiddler(w, h);
+	return *twiddler;
+}
+
 int Twiddler::twiddle(int* output, int stride, int x, int y, int blocksize, int seq) const {
 	int before = seq;
 
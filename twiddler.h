@@ -10,6 +10,10 @@ public:
 	Twiddler(int w, int h);
 	~Twiddler();
 
+	// A twiddler for w x h that's built once and kept for the rest of the
+	// process, so repeated conversions don't rebuild the same tables.
+	static const Twiddler& shared(int w, int h);
+
 	int	index(int x, int y) const { return m_index[y * m_width + x]; }
 	int index(int i)		const { return m_index[i]; }
 
@@ -7,13 +7,23 @@
 #include <QElapsedTimer>
 #include <QColor>
 #include <QFile>
+#include <QThread>
 #include <cmath>
+#include <algorithm>
+#include <limits>
+#include <random>
+#include <QtConcurrent>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define VQ_USE_SSE
+#endif
 
 // N-dimensional vectors, for input to a VectorQuantizer.
 template <uint N>
 class Vec {
 public:
-	Vec(uint hval = 0) : hashVal(hval) {}
+	Vec() {}
 	Vec(const Vec<N>& other);
 	void	zero();
 	void	operator= (const Vec<N>& other);
@@ -32,39 +42,192 @@ public:
 	void	normalize();
 	void	print() const;
 	static float distanceSquared(const Vec<N>& a, const Vec<N>& b);
-	uint	hash() const;
-	void	setHash(uint h) { hashVal = h; }
 private:
 	float	v[N];
-	uint	hashVal; // Only used for the constant input vectors, so we only need to calc once.
-	quint64	lololol; // Speeds up the average compression by a couple of seconds on my machine. Probably some alignment stuff.
+};
+
+// Hash key for a vector in a VecStore, for removing duplicates. Points at
+// the row, and compares like Vec<N>::operator==.
+template <uint N>
+struct VecKey {
+	const float*	row;
+	uint			hash;
+	bool operator== (const VecKey<N>& other) const {
+		for (uint i=0; i<N; i++)
+			if (qAbs(row[i] - other.row[i]) > 0.001f)
+				return false;
+		return true;
+	}
+};
+
+template<uint N>
+inline uint qHash(const VecKey<N>& key) {
+	return key.hash;
+}
+
+// Storage for the input vectors of a VectorQuantizer. The vectors are kept
+// in one block as rows of floats, padded to 32 bytes and 32-byte aligned, so
+// they can be streamed straight into the search kernels. The hashes, which are
+// only needed to remove duplicates, are kept in a separate array.
+template <uint N>
+class VecStore {
+public:
+	static const int STRIDE = (N + 7) & ~7;	// Floats per row
+
+	VecStore() {}
+	VecStore(const VecStore<N>& other) { *this = other; }
+	~VecStore() { qFreeAligned(rows); }
+	VecStore<N>& operator= (const VecStore<N>& other);
+
+	int		size() const { return count; }
+	bool	isEmpty() const { return count == 0; }
+	void	clear();
+	void	reserve(int capacity);
+	void	push_back(const Vec<N>& vec, uint hash = 0);
+	void	swap(int a, int b);
+
+	// The rows are plain floats, so the vectors are copied out of them
+	// rather than aliased. Use row() to read them in place.
+	Vec<N>			operator[] (int index) const;
+	const float*	row(int index) const { return rows + index * STRIDE; }
+	uint			hash(int index) const { return hashes[index]; }
+private:
+	float*			rows = nullptr;
+	int				count = 0;
+	int				allocated = 0;
+	QVector<uint>	hashes;
+};
+
+// Codebook initialization methods
+#define VQ_INIT_SPLIT		0	// Repeatedly split every code in two (LBG)
+#define VQ_INIT_KMEANSPP	1	// Weighted k-means++ seeding
+#define VQ_INIT_PCA			2	// Split the worst cluster along its principal axis
+
+// Mini-batch sample sizes, in unique vectors
+#define VQ_MINIBATCH_MIN		4096
+#define VQ_MINIBATCH_PER_CODE	64
+
+// Nearest code search methods
+#define VQ_SEARCH_EXACT		0	// Compare against every code
+#define VQ_SEARCH_APPROX	1	// Shortlist in a projected space, exact re-ranking
+
+// Approximate search parameters. Vectors are projected onto the first few
+// principal axes of the codebook, and the codes closest to them there make
+// the shortlist.
+#define VQ_APPROX_MIN_DIM		32	// Smaller vectors always use the exact search
+#define VQ_APPROX_MIN_CODES		64	// As do small codebooks
+#define VQ_APPROX_DIMS			8
+#define VQ_APPROX_SHORTLIST		8
+#define VQ_APPROX_RECALL_STRIDE	64	// Check every n:th search against the exact search
+
+// Batched search blocking. The codebook is packed in panels of 8 codes, and
+// the input is processed in tiles, 4 vectors at a time, against a few panels
+// at a time so both stay in the cache.
+#define VQ_PANEL_CODES		8
+#define VQ_TILE_VECTORS		64
+#define VQ_TILE_PANELS		8
+
+// Inputs with fewer vectors than this are deduplicated on a single thread
+#define VQ_RLE_PARALLEL_MIN	65536
+
+// Tunable settings for a VectorQuantizer.
+struct VQSettings {
+	int		init = VQ_INIT_SPLIT;
+	int		search = VQ_SEARCH_EXACT;
+	bool	miniBatch = false;	// Build the initial codebook from a random sample of the input.
+	quint32	seed = 1;			// For the randomized methods. Same seed => same codebook.
+	int		starts = 1;			// Independently seeded runs, the one with the lowest distortion is kept.
+	int		codes = 256;		// Max number of codes in a compressed texture's codebook.
+	bool	trimCodebook = false;	// Only store the codes that are used in compressed textures.
+	bool	trainOnTexels = false;	// Train compressed YUV422 and BUMPMAP on the stored texel bytes instead of on RGB.
 };
 
 // VectorQuantizer, compresses N-dimensional vectors
 template <uint N>
 class VectorQuantizer {
 public:
-	void clear() { codes.clear(); }
+	VectorQuantizer(const VQSettings& settings = VQSettings()) : settings(settings) {}
+	void clear() { codes.clear(); codePanels.clear(); codeNorms.clear(); approxAxes.clear(); approxCodes.clear(); }
 	int	codeCount() const { return codes.size(); }
 	int findClosest(const Vec<N>& vec) const;
+	int findClosestExact(const Vec<N>& vec) const;
+	void findClosest(const VecStore<N>& vectors, QVector<int>& indices) const;
 	const Vec<N>& codeVector(int index) const { return codes[index].codeVec; }
-	void compress(const QVector<Vec<N>>& vectors, int numCodes);
+	void compress(const VecStore<N>& vectors, int numCodes);
+	double distortion() const { return totalDistortion; }
 	bool writeReportToFile(const QString& filename);
 private:
-	int findBestSplitCandidate() const;
+	struct SplitCandidate {
+		float	maxDistance;
+		int		index;
+		bool operator< (const SplitCandidate& other) const { return maxDistance < other.maxDistance; }
+	};
+
+	void buildSplitCandidates();
+	void pushSplitCandidate(int index);
+	int popSplitCandidate();
 	void removeUnusedCodes();
-	void place(const QHash<Vec<N>, int>& vectors);
+	void resetCode(int index);
+	void addToCode(int index, int vecIndex);
+	void updateCodeVectors(const QVector<int>& indices);
+	void place();
+	void placeLocal(const QVector<int>& parents, const QVector<int>& children);
 	void split();
-	void splitCode(int index);
+	int splitCode(int index);
+	void initSplit(int numCodes);
+	void initKMeansPlusPlus(int numCodes);
+	void initPrincipalSplit(int numCodes);
+	void refine(int passes);
+	void shuffle();
+	void sample(int numCodes);
+	void train(int numCodes);
+	void trainMultiStart(int numCodes);
+	void measureDistortion();
+	void buildSearchIndex();
+	void packCodebook();
+	void findClosestBatch(const VecStore<N>& vecs, int count, int* indices) const;
+	int findClosestApprox(const Vec<N>& vec) const;
 
 	struct Code {
 		int		vecCount;
 		Vec<N>	vecSum;
 		float	maxDistance;
-		Vec<N>	maxDistanceVec;
+		int		maxDistanceIndex;	// Unique vector furthest away from the code
 		Vec<N>	codeVec;
 	};
 	QVector<Code> codes;
+
+	// The unique input vectors, how many times each one occurs in the input
+	// and which code each one is currently placed in. Only valid during compress().
+	// They start out in order of first occurrence in the input, and everything
+	// seeded (shuffle(), k-means++, multiple starts) relies on that to give
+	// the same codebook every time.
+	VecStore<N>		uniqueVecs;
+	QVector<int>	uniqueCounts;
+	QVector<int>	assignments;
+
+	// Only the first activeCount unique vectors are used for training. This
+	// is less than all of them while building a mini-batch codebook.
+	int				activeCount = 0;
+
+	// Max-heap of codes that can be split, ordered by max distance.
+	QVector<SplitCandidate> splitCandidates;
+
+	// Packed codebook for the batched search, and the squared length of every
+	// code. Padded up to a whole panel with codes that are never picked.
+	QVector<float>	codePanels;		// [panel][N][VQ_PANEL_CODES]
+	QVector<float>	codeNorms;
+
+	// Projected codebook for the approximate search. Empty when the exact
+	// search is used.
+	QVector<float>	approxAxes;		// [axis][N]
+	QVector<float>	approxCodes;	// [code][axis]
+	int				recallSamples = 0;
+	int				recallHits = 0;
+
+	VQSettings	settings;
+	int			placeCount = 0;
+	double		totalDistortion = 0;
 };
 
 template<uint N>
@@ -115,7 +278,6 @@ template<uint N>
 inline void Vec<N>::operator= (const Vec<N>& other) {
 	for (uint i=0; i<N; ++i)
 		v[i] = other.v[i];
-	hashVal = other.hashVal;
 }
 
 template<uint N>
@@ -221,27 +383,89 @@ float Vec<N>::distanceSquared(const Vec<N>& a, const Vec<N>& b) {
 }
 
 template<uint N>
-inline uint	Vec<N>::hash() const {
-	return hashVal;
+VecStore<N>& VecStore<N>::operator= (const VecStore<N>& other) {
+	if (this != &other) {
+		clear();
+		reserve(other.count);
+		if (other.count > 0)
+			memcpy(rows, other.rows, other.count * STRIDE * sizeof(float));
+		count = other.count;
+		hashes = other.hashes;
+	}
+	return *this;
+}
+
+template<uint N>
+void VecStore<N>::clear() {
+	qFreeAligned(rows);
+	rows = nullptr;
+	count = 0;
+	allocated = 0;
+	hashes.clear();
+}
+
+template<uint N>
+void VecStore<N>::reserve(int capacity) {
+	if (capacity <= allocated)
+		return;
+	float* newRows = (float*)qMallocAligned(capacity * STRIDE * sizeof(float), 32);
+	if (count > 0)
+		memcpy(newRows, rows, count * STRIDE * sizeof(float));
+	qFreeAligned(rows);
+	rows = newRows;
+	allocated = capacity;
+	hashes.reserve(capacity);
+}
+
+template<uint N>
+inline void VecStore<N>::push_back(const Vec<N>& vec, uint hash) {
+	if (count == allocated)
+		reserve(qMax(1024, allocated * 2));
+	float* row = rows + count * STRIDE;
+	for (uint i=0; i<N; i++)
+		row[i] = vec[i];
+	for (int i=N; i<STRIDE; i++)
+		row[i] = 0;
+	hashes.push_back(hash);
+	count++;
 }
 
 template<uint N>
-uint qHash(const Vec<N>& vec) {
-	return vec.hash();
+inline Vec<N> VecStore<N>::operator[] (int index) const {
+	const float* row = rows + index * STRIDE;
+	Vec<N> vec;
+	for (uint i=0; i<N; i++)
+		vec.set(i, row[i]);
+	return vec;
+}
+
+template<uint N>
+inline void VecStore<N>::swap(int a, int b) {
+	float* rowA = rows + a * STRIDE;
+	float* rowB = rows + b * STRIDE;
+	for (int i=0; i<STRIDE; i++)
+		qSwap(rowA[i], rowB[i]);
+	qSwap(hashes[a], hashes[b]);
 }
 
 template<uint N>
 int VectorQuantizer<N>::findClosest(const Vec<N> &vec) const {
-	// TODO: This search is O(n), and the place where most of the
-	// compression time is spent. Find a better algorithm.
+	// This search is O(n), and the place where most of the
+	// compression time is spent.
 	//
 	// kd-trees are not an option, they won't perform better than
 	// linear searches at high dimensions unless you have a lot of
 	// vectors. Specifically nVectors > 2^DIM.
 	//
-	// Locality sensitive hashing should speed it up, but comes
-	// at a quality cost.
+	// The approximate search speeds it up for large vectors, but
+	// comes at a quality cost.
+	if (!approxCodes.isEmpty())
+		return findClosestApprox(vec);
+	return findClosestExact(vec);
+}
 
+template<uint N>
+int VectorQuantizer<N>::findClosestExact(const Vec<N> &vec) const {
 	if (codes.size() <= 1)
 		return 0;
 	int closestIndex = 0;
@@ -259,70 +483,440 @@ int VectorQuantizer<N>::findClosest(const Vec<N> &vec) const {
 	return closestIndex;
 }
 
+// Micro-kernel for the batched search. Finds the closest of the 8 codes in a
+// panel for 4 input vectors, stride floats apart, using
+// |x-c|^2 = |x|^2 - 2x.c + |c|^2. |x|^2 is the same for every code, so it's
+// left out of the comparison.
+template<uint N>
+inline void vqScorePanel(const float* x, int stride, const float* panel, const float* norms, int firstCode, float* best, int* closest) {
+	float dots[4][VQ_PANEL_CODES];
+#ifdef VQ_USE_SSE
+	__m128 acc00 = _mm_setzero_ps(), acc01 = _mm_setzero_ps();
+	__m128 acc10 = _mm_setzero_ps(), acc11 = _mm_setzero_ps();
+	__m128 acc20 = _mm_setzero_ps(), acc21 = _mm_setzero_ps();
+	__m128 acc30 = _mm_setzero_ps(), acc31 = _mm_setzero_ps();
+	for (uint j=0; j<N; j++) {
+		const __m128 c0 = _mm_loadu_ps(panel + j * VQ_PANEL_CODES);
+		const __m128 c1 = _mm_loadu_ps(panel + j * VQ_PANEL_CODES + 4);
+		const __m128 x0 = _mm_set1_ps(x[0 * stride + j]);
+		const __m128 x1 = _mm_set1_ps(x[1 * stride + j]);
+		const __m128 x2 = _mm_set1_ps(x[2 * stride + j]);
+		const __m128 x3 = _mm_set1_ps(x[3 * stride + j]);
+		acc00 = _mm_add_ps(acc00, _mm_mul_ps(x0, c0));
+		acc01 = _mm_add_ps(acc01, _mm_mul_ps(x0, c1));
+		acc10 = _mm_add_ps(acc10, _mm_mul_ps(x1, c0));
+		acc11 = _mm_add_ps(acc11, _mm_mul_ps(x1, c1));
+		acc20 = _mm_add_ps(acc20, _mm_mul_ps(x2, c0));
+		acc21 = _mm_add_ps(acc21, _mm_mul_ps(x2, c1));
+		acc30 = _mm_add_ps(acc30, _mm_mul_ps(x3, c0));
+		acc31 = _mm_add_ps(acc31, _mm_mul_ps(x3, c1));
+	}
+	_mm_storeu_ps(dots[0], acc00);	_mm_storeu_ps(dots[0] + 4, acc01);
+	_mm_storeu_ps(dots[1], acc10);	_mm_storeu_ps(dots[1] + 4, acc11);
+	_mm_storeu_ps(dots[2], acc20);	_mm_storeu_ps(dots[2] + 4, acc21);
+	_mm_storeu_ps(dots[3], acc30);	_mm_storeu_ps(dots[3] + 4, acc31);
+#else
+	for (int r=0; r<4; r++)
+		for (int k=0; k<VQ_PANEL_CODES; k++)
+			dots[r][k] = 0;
+	for (uint j=0; j<N; j++)
+		for (int r=0; r<4; r++)
+			for (int k=0; k<VQ_PANEL_CODES; k++)
+				dots[r][k] += x[r * stride + j] * panel[j * VQ_PANEL_CODES + k];
+#endif
+
+	for (int r=0; r<4; r++) {
+		for (int k=0; k<VQ_PANEL_CODES; k++) {
+			const float distance = norms[k] - 2.0f * dots[r][k];
+			if (distance < best[r]) {
+				best[r] = distance;
+				closest[r] = firstCode + k;
+			}
+		}
+	}
+}
+
+template<uint N>
+void VectorQuantizer<N>::findClosest(const VecStore<N>& vectors, QVector<int>& indices) const {
+	indices.resize(vectors.size());
+	findClosestBatch(vectors, vectors.size(), indices.data());
+}
+
+template<uint N>
+void VectorQuantizer<N>::findClosestBatch(const VecStore<N>& vecs, int count, int* indices) const {
+	if (!approxCodes.isEmpty() || codeNorms.isEmpty() || codes.size() <= 1) {
+		for (int i=0; i<count; i++)
+			indices[i] = findClosest(vecs[i]);
+		return;
+	}
+
+	const int STRIDE = VecStore<N>::STRIDE;
+	const int panels = codeNorms.size() / VQ_PANEL_CODES;
+	float tail[4 * STRIDE];
+	float best[VQ_TILE_VECTORS];
+	int closest[VQ_TILE_VECTORS];
+
+	for (int first=0; first<count; first+=VQ_TILE_VECTORS) {
+		// The rows are read in place. Only a last group of less than 4 vectors
+		// is copied, padded by repeating the last one.
+		const int size = qMin(VQ_TILE_VECTORS, count - first);
+		const int padded = (size + 3) & ~3;
+		for (int v=0; v<padded; v++) {
+			best[v] = std::numeric_limits<float>::infinity();
+			closest[v] = 0;
+		}
+		if (padded != size) {
+			for (int v=0; v<4; v++)
+				memcpy(tail + v * STRIDE, vecs.row(first + qMin(padded - 4 + v, size - 1)), STRIDE * sizeof(float));
+		}
+
+		for (int block=0; block<panels; block+=VQ_TILE_PANELS) {
+			const int blockEnd = qMin(panels, block + VQ_TILE_PANELS);
+			for (int v=0; v<padded; v+=4) {
+				const float* x = (v + 4 <= size) ? vecs.row(first + v) : tail;
+				for (int p=block; p<blockEnd; p++) {
+					vqScorePanel<N>(x, STRIDE, codePanels.constData() + p * N * VQ_PANEL_CODES,
+						codeNorms.constData() + p * VQ_PANEL_CODES, p * VQ_PANEL_CODES, best + v, closest + v);
+				}
+			}
+		}
+
+		for (int v=0; v<size; v++)
+			indices[first + v] = closest[v];
+	}
+}
+
 template<uint N>
-int VectorQuantizer<N>::findBestSplitCandidate() const {
-	int retval = -1;
-	float furthest = 0;
+void VectorQuantizer<N>::packCodebook() {
+	const int panels = (codes.size() + VQ_PANEL_CODES - 1) / VQ_PANEL_CODES;
+	codePanels.fill(0.0f, panels * N * VQ_PANEL_CODES);
+	codeNorms.fill(std::numeric_limits<float>::infinity(), panels * VQ_PANEL_CODES);
 	for (int i=0; i<codes.size(); i++) {
-		if (codes[i].vecCount > 1 && codes[i].maxDistance > furthest) {
-			furthest = codes[i].maxDistance;
-			retval = i;
+		float* panel = codePanels.data() + (i / VQ_PANEL_CODES) * N * VQ_PANEL_CODES + (i % VQ_PANEL_CODES);
+		for (uint j=0; j<N; j++)
+			panel[j * VQ_PANEL_CODES] = codes[i].codeVec[j];
+		codeNorms[i] = codes[i].codeVec.lengthSquared();
+	}
+}
+
+template<uint N>
+int VectorQuantizer<N>::findClosestApprox(const Vec<N>& vec) const {
+	// Project the vector onto the principal axes of the codebook
+	float projected[VQ_APPROX_DIMS];
+	const float* axis = approxAxes.constData();
+	for (int p=0; p<VQ_APPROX_DIMS; p++, axis += N) {
+		float dot = 0;
+		for (uint j=0; j<N; j++)
+			dot += vec[j] * axis[j];
+		projected[p] = dot;
+	}
+
+	// Keep the codes closest to it in the projected space, sorted. The
+	// projected distance never overestimates the real one.
+	int shortlist[VQ_APPROX_SHORTLIST];
+	float estimates[VQ_APPROX_SHORTLIST];
+	int listed = 0;
+	const float* code = approxCodes.constData();
+	for (int i=0; i<codes.size(); i++, code += VQ_APPROX_DIMS) {
+		float estimate = 0;
+		for (int p=0; p<VQ_APPROX_DIMS; p++) {
+			const float d = projected[p] - code[p];
+			estimate += d * d;
+		}
+
+		if (listed == VQ_APPROX_SHORTLIST && estimate >= estimates[listed - 1])
+			continue;
+		int j = (listed < VQ_APPROX_SHORTLIST) ? listed++ : (listed - 1);
+		for (; j>0 && estimates[j - 1] > estimate; j--) {
+			estimates[j] = estimates[j - 1];
+			shortlist[j] = shortlist[j - 1];
+		}
+		estimates[j] = estimate;
+		shortlist[j] = i;
+	}
+
+	// Exact re-ranking of the shortlist
+	int closestIndex = shortlist[0];
+	float closestDistance = Vec<N>::distanceSquared(codes[closestIndex].codeVec, vec);
+	for (int i=1; i<listed; i++) {
+		if (estimates[i] >= closestDistance)
+			break;
+		const float distance = Vec<N>::distanceSquared(codes[shortlist[i]].codeVec, vec);
+		if (distance < closestDistance) {
+			closestIndex = shortlist[i];
+			closestDistance = distance;
+		}
+	}
+	return closestIndex;
+}
+
+template<uint N>
+void VectorQuantizer<N>::buildSearchIndex() {
+	// Pack the codebook for the batched search. For the approximate search,
+	// also find the principal axes of the code vectors with power iteration
+	// and deflation, and store every code projected onto them. Cheap compared
+	// to a place() pass, so it's redone every time the codebook has moved.
+	packCodebook();
+	approxAxes.clear();
+	approxCodes.clear();
+	if (settings.search != VQ_SEARCH_APPROX || N < VQ_APPROX_MIN_DIM || codes.size() < VQ_APPROX_MIN_CODES)
+		return;
+
+	Vec<N> mean;
+	mean.zero();
+	for (int i=0; i<codes.size(); i++)
+		mean += codes[i].codeVec;
+	mean /= (float)codes.size();
+
+	QVector<float> covariance(N * N, 0.0f);
+	for (int i=0; i<codes.size(); i++) {
+		const Vec<N> diff = codes[i].codeVec - mean;
+		for (uint j=0; j<N; j++)
+			for (uint k=0; k<N; k++)
+				covariance[j * N + k] += diff[j] * diff[k];
+	}
+
+	approxAxes.resize(VQ_APPROX_DIMS * N);
+	for (int p=0; p<VQ_APPROX_DIMS; p++) {
+		float* axis = approxAxes.data() + p * N;
+
+		// Start from the dimension with the most variance left. If there's
+		// none, the codes are covered by the axes so far, and the rest are
+		// left at zero so they don't add to the estimates.
+		uint start = 0;
+		for (uint j=1; j<N; j++)
+			if (covariance[j * N + j] > covariance[start * N + start])
+				start = j;
+		if (covariance[start * N + start] <= 0) {
+			std::fill(approxAxes.begin() + p * N, approxAxes.end(), 0.0f);
+			break;
+		}
+		for (uint j=0; j<N; j++)
+			axis[j] = (j == start) ? 1.0f : 0.0f;
+
+		float eigenvalue = 0;
+		for (int iteration=0; iteration<16; iteration++) {
+			float next[N];
+			float lengthSquared = 0;
+			for (uint j=0; j<N; j++) {
+				float dot = 0;
+				for (uint k=0; k<N; k++)
+					dot += covariance[j * N + k] * axis[k];
+				next[j] = dot;
+				lengthSquared += dot * dot;
+			}
+			if (lengthSquared <= 0)
+				break;
+			eigenvalue = sqrt(lengthSquared);
+			for (uint j=0; j<N; j++)
+				axis[j] = next[j] / eigenvalue;
+		}
+
+		// 16 iterations don't always converge when eigenvalues are close, so
+		// make the axis orthogonal to the earlier ones. The projected
+		// distance only never overestimates the real one for orthonormal axes.
+		for (int q=0; q<p; q++) {
+			const float* other = approxAxes.constData() + q * N;
+			float dot = 0;
+			for (uint j=0; j<N; j++)
+				dot += axis[j] * other[j];
+			for (uint j=0; j<N; j++)
+				axis[j] -= dot * other[j];
+		}
+		float length = 0;
+		for (uint j=0; j<N; j++)
+			length += axis[j] * axis[j];
+		length = sqrt(length);
+		if (length < 1e-4f) {
+			std::fill(approxAxes.begin() + p * N, approxAxes.end(), 0.0f);
+			break;
+		}
+		for (uint j=0; j<N; j++)
+			axis[j] /= length;
+
+		// Remove this axis from the covariance, so the next one is found in
+		// what's left
+		eigenvalue = 0;
+		for (uint j=0; j<N; j++)
+			for (uint k=0; k<N; k++)
+				eigenvalue += axis[j] * covariance[j * N + k] * axis[k];
+		for (uint j=0; j<N; j++)
+			for (uint k=0; k<N; k++)
+				covariance[j * N + k] -= eigenvalue * axis[j] * axis[k];
+	}
+
+	approxCodes.resize(codes.size() * VQ_APPROX_DIMS);
+	for (int i=0; i<codes.size(); i++) {
+		const Vec<N>& codeVec = codes[i].codeVec;
+		const float* axis = approxAxes.constData();
+		for (int p=0; p<VQ_APPROX_DIMS; p++, axis += N) {
+			float dot = 0;
+			for (uint j=0; j<N; j++)
+				dot += codeVec[j] * axis[j];
+			approxCodes[i * VQ_APPROX_DIMS + p] = dot;
 		}
 	}
-	return retval;
+}
+
+template<uint N>
+void VectorQuantizer<N>::buildSplitCandidates() {
+	splitCandidates.clear();
+	for (int i=0; i<codes.size(); i++)
+		pushSplitCandidate(i);
+}
+
+template<uint N>
+void VectorQuantizer<N>::pushSplitCandidate(int index) {
+	// Codes with a single vector, or only identical vectors, can't be split.
+	const Code& code = codes[index];
+	if (code.vecCount > 1 && code.maxDistance > 0) {
+		SplitCandidate candidate;
+		candidate.maxDistance = code.maxDistance;
+		candidate.index = index;
+		splitCandidates.push_back(candidate);
+		std::push_heap(splitCandidates.begin(), splitCandidates.end());
+	}
+}
+
+template<uint N>
+int VectorQuantizer<N>::popSplitCandidate() {
+	if (splitCandidates.isEmpty())
+		return -1;
+	std::pop_heap(splitCandidates.begin(), splitCandidates.end());
+	const int index = splitCandidates.last().index;
+	splitCandidates.removeLast();
+	return index;
 }
 
 template<uint N>
 void VectorQuantizer<N>::removeUnusedCodes() {
-	int removed = 0;
+	// Compact the codebook in one pass and remember where every code ended up,
+	// so the vector assignments stay valid.
+	QVector<int> remap(codes.size(), -1);
+	int used = 0;
 	for (int i=0; i<codes.size(); i++) {
-		if (codes[i].vecCount == 0) {
-			codes.removeAt(i);
-			--i;
-			++removed;
+		if (codes[i].vecCount > 0) {
+			if (used != i)
+				codes[used] = codes[i];
+			remap[i] = used++;
 		}
 	}
-	if (removed > 0)
+
+	const int removed = codes.size() - used;
+	if (removed > 0) {
+		codes.resize(used);
+		for (int i=0; i<activeCount; i++)
+			assignments[i] = remap[assignments[i]];
 		qDebug() << "Removed" << removed << "unused codes";
+	}
+}
+
+template<uint N>
+inline void VectorQuantizer<N>::resetCode(int index) {
+	Code& code = codes[index];
+	code.vecCount = 0;
+	code.vecSum.zero();
+	code.maxDistance = 0;
+	code.maxDistanceIndex = -1;
+}
+
+template<uint N>
+inline void VectorQuantizer<N>::addToCode(int index, int vecIndex) {
+	Code& code = codes[index];
+	const Vec<N> vec = uniqueVecs[vecIndex];
+	const int count = uniqueCounts[vecIndex];
+
+	assignments[vecIndex] = index;
+
+	// Update the average
+	code.vecSum.addMultiplied(vec, count);
+	code.vecCount += count;
+
+	// Update the max distance if needed
+	float distance = Vec<N>::distanceSquared(code.codeVec, vec);
+	if (distance > code.maxDistance) {
+		code.maxDistance = distance;
+		code.maxDistanceIndex = vecIndex;
+	}
+}
+
+template<uint N>
+void VectorQuantizer<N>::updateCodeVectors(const QVector<int>& indices) {
+	for (int i=0; i<indices.size(); i++) {
+		Code& code = codes[indices[i]];
+		if (code.vecCount > 0) {
+			// Normalize the sum and update the code vector
+			code.vecSum /= (float)code.vecCount;
+			code.codeVec = code.vecSum;
+		}
+	}
 }
 
 template<uint N>
-void VectorQuantizer<N>::place(const QHash<Vec<N>, int> &vecs) {
+void VectorQuantizer<N>::place() {
 	// Reset the encoding-related code variables
+	QVector<int> all(codes.size());
 	for (int i=0; i<codes.size(); i++) {
-		codes[i].vecCount = 0;
-		codes[i].vecSum.zero();
-		codes[i].maxDistance = 0;
-		codes[i].maxDistanceVec.zero();
+		resetCode(i);
+		all[i] = i;
 	}
 
-	QHashIterator<Vec<N>, int> it(vecs);
-	while (it.hasNext()) {
-		it.next();
-		const Vec<N>& vec = it.key();
-		const int count = it.value();
+	buildSearchIndex();
+	QVector<int> closest(activeCount);
+	findClosestBatch(uniqueVecs, activeCount, closest.data());
 
-		// Find closest code
-		Code& code = codes[findClosest(vec)];
+	for (int i=0; i<activeCount; i++) {
+		addToCode(closest[i], i);
 
-		// Update the average
-		code.vecSum.addMultiplied(vec, count);
-		code.vecCount += count;
+		// Keep track of how often the approximate search gets it right
+		if (!approxCodes.isEmpty() && (i % VQ_APPROX_RECALL_STRIDE) == 0) {
+			recallSamples++;
+			if (closest[i] == findClosestExact(uniqueVecs[i]))
+				recallHits++;
+		}
+	}
+
+	updateCodeVectors(all);
+	if (activeCount == uniqueVecs.size())
+		placeCount++;
+}
 
-		// Update the max distance if needed
-		float distance = Vec<N>::distanceSquared(code.codeVec, vec);
-		if (distance > code.maxDistance) {
-			code.maxDistance = distance;
-			code.maxDistanceVec = vec;
+template<uint N>
+void VectorQuantizer<N>::placeLocal(const QVector<int>& parents, const QVector<int>& children) {
+	// Only the vectors that belonged to a code that was just split can have
+	// moved, and they can only have moved to the new half of that code. So
+	// re-place those vectors between the two halves, and leave the rest of the
+	// codebook alone.
+	QVector<int> sibling(codes.size(), -1);
+	for (int i=0; i<parents.size(); i++)
+		sibling[parents[i]] = children[i];
+
+	QVector<int> members;
+	QVector<int> memberParents;
+	for (int i=0; i<assignments.size(); i++) {
+		if (sibling[assignments[i]] != -1) {
+			members.push_back(i);
+			memberParents.push_back(assignments[i]);
 		}
 	}
 
-	for (int i=0; i<codes.size(); i++) {
-		if (codes[i].vecCount > 0) {
-			// Normalize the sum and update the code vector
-			codes[i].vecSum /= (float)codes[i].vecCount;
-			codes[i].codeVec = codes[i].vecSum;
+	const QVector<int> affected = parents + children;
+
+	for (int pass=0; pass<3; pass++) {
+		for (int i=0; i<affected.size(); i++)
+			resetCode(affected[i]);
+
+		for (int i=0; i<members.size(); i++) {
+			const int vecIndex = members[i];
+			const Vec<N> vec = uniqueVecs[vecIndex];
+			const int parent = memberParents[i];
+			const int child = sibling[parent];
+			const float parentDistance = Vec<N>::distanceSquared(codes[parent].codeVec, vec);
+			const float childDistance = Vec<N>::distanceSquared(codes[child].codeVec, vec);
+			addToCode((childDistance < parentDistance) ? child : parent, vecIndex);
 		}
+
+		updateCodeVectors(affected);
 	}
 }
 
@@ -339,61 +933,75 @@ void VectorQuantizer<N>::split() {
 }
 
 template<uint N>
-void VectorQuantizer<N>::splitCode(int index) {
+int VectorQuantizer<N>::splitCode(int index) {
 	// Split this code into two by moving the code vector away from the max
 	// distance vector and the new code vector towards the max distance vector
 	// byt a tiny amount and let the place() iterations tear them apart.
 	Code& code = codes[index];
-	Vec<N> diff = code.maxDistanceVec - code.codeVec;
+	Vec<N> diff;
+	diff.zero();
+	if (code.maxDistanceIndex >= 0)
+		diff = uniqueVecs[code.maxDistanceIndex];
+	diff -= code.codeVec;
 	diff.setLength(0.01);
 	Vec<N> newVec = code.codeVec;
 	newVec += diff;
 	code.codeVec -= diff;
 	codes.push_back(Code());
 	codes.last().codeVec = newVec;
+	return codes.size() - 1;
 }
 
 template<uint N>
-void VectorQuantizer<N>::compress(const QVector<Vec<N>>& vectors, int numCodes) {
-	int splits = 0;
-	int repairs = 0;
+void VectorQuantizer<N>::refine(int passes) {
+	for (int i=0; i<passes; i++)
+		place();
+	removeUnusedCodes();
+}
 
-	QElapsedTimer timer;
-	timer.start();
+template<uint N>
+void VectorQuantizer<N>::shuffle() {
+	// Fisher-Yates shuffle of the unique vectors. Any prefix of them is then a
+	// random sample, and the vector counts are kept as weights. Uses the raw
+	// mt19937 output so the order is the same on every platform. The
+	// vectors come in order of first occurrence, not hash order, so the
+	// shuffled order only depends on the input and the seed.
+	std::mt19937 rng(settings.seed);
+	for (int i=uniqueVecs.size()-1; i>0; i--) {
+		const int j = rng() % (i + 1);
+		uniqueVecs.swap(i, j);
+		qSwap(uniqueCounts[i], uniqueCounts[j]);
+	}
+}
 
-	// The input vectors don't have to be in a specific order, so to save a lot
-	// of time later, we remove all duplicates and store the vectors in a hash
-	// <vec, num_occurances>. This isn't as slow as it sounds since the vectors
-	// have very efficient hashing.
-	QHash<Vec<N>, int> rle;
-	for (int i=0; i<vectors.size(); i++) {
-		const Vec<N>& vec = vectors[i];
-		if (rle.contains(vec))
-			rle[vec]++;
-		else
-			rle.insert(vec, 1);
+template<uint N>
+void VectorQuantizer<N>::sample(int numCodes) {
+	// Train on just enough vectors to give each code a decent amount of them.
+	// The sample only ever grows, so earlier training isn't wasted.
+	if (settings.miniBatch) {
+		const int wanted = qMax(VQ_MINIBATCH_MIN, numCodes * VQ_MINIBATCH_PER_CODE);
+		activeCount = qMax(activeCount, qMin(uniqueVecs.size(), wanted));
 	}
+}
 
-	qDebug() << "RLE completed in" << timer.elapsed() << "ms";
-	qDebug() << "RLE result:" << vectors.size() << "=>" << rle.size();
+template<uint N>
+void VectorQuantizer<N>::initSplit(int numCodes) {
+	int splits = 0;
 
 	// Start out with 1 code.
-	codes.clear();
 	codes.resize(1);
-	codes.reserve(numCodes);
+	sample(1);
 
 	// Place the average of all vectors in that first code.
-	place(rle);
+	place();
 
 	// Split the codebook as many times as we can.
 	while ((codes.size() * 2) <= numCodes) {
 		int codesBefore = codes.size();
 
+		sample(codes.size() * 2);
 		split();
-		place(rle);
-		place(rle);
-		place(rle);
-		removeUnusedCodes();
+		refine(3);
 
 		if (codes.size() == codesBefore) {
 			qDebug() << "Could not further improve the codebook by splitting";
@@ -403,22 +1011,307 @@ void VectorQuantizer<N>::compress(const QVector<Vec<N>>& vectors, int numCodes)
 		splits++;
 		qDebug() << "Split" << splits << "done. Codes:" << codeCount();
 	}
+}
+
+template<uint N>
+void VectorQuantizer<N>::initKMeansPlusPlus(int numCodes) {
+	// k-means++ seeding, with each unique vector weighted by how many times it
+	// occurs. The first code is picked at random, and every following code is
+	// picked with a probability proportional to weight * distance^2 to the
+	// closest code picked so far. That spreads the codes out over the input
+	// in one pass per code, instead of growing the codebook one split at a time.
+	// The picks walk the unique vectors in order, so the seeding is only the
+	// same from run to run because compress() keeps them in input order.
+	sample(numCodes);
+
+	std::mt19937 rng(settings.seed);
+	const int count = activeCount;
+	QVector<float> closest(count, std::numeric_limits<float>::max());
+
+	int pick = 0;
+	double total = 0;
+	for (int i=0; i<count; i++)
+		total += uniqueCounts[i];
+	double target = (rng() / 4294967296.0) * total;
+	for (pick=0; pick<(count-1); pick++) {
+		target -= uniqueCounts[pick];
+		if (target < 0)
+			break;
+	}
+
+	while (codes.size() < numCodes) {
+		codes.push_back(Code());
+		codes.last().codeVec = uniqueVecs[pick];
+
+		// Update the distances to the closest code and pick the next one
+		total = 0;
+		for (int i=0; i<count; i++) {
+			const float distance = Vec<N>::distanceSquared(uniqueVecs[i], codes.last().codeVec);
+			if (distance < closest[i])
+				closest[i] = distance;
+			total += closest[i] * uniqueCounts[i];
+		}
+
+		// Every vector is already a code
+		if (total <= 0)
+			break;
+
+		target = (rng() / 4294967296.0) * total;
+		for (pick=0; pick<(count-1); pick++) {
+			target -= closest[pick] * uniqueCounts[pick];
+			if (target < 0 && closest[pick] > 0)
+				break;
+		}
+	}
+
+	refine(3);
+}
+
+template<uint N>
+void VectorQuantizer<N>::initPrincipalSplit(int numCodes) {
+	// Top-down splitting in the spirit of median cut. The cluster with the
+	// largest squared error is cut in two by a plane through its mean,
+	// perpendicular to its principal axis. Each cut only touches the vectors
+	// in that cluster, so this is a lot cheaper than a place() pass.
+	sample(numCodes);
+
+	QVector<QVector<int>> members(1);
+	QVector<float> errors(1);
+	members[0].resize(activeCount);
+	for (int i=0; i<activeCount; i++)
+		members[0][i] = i;
+
+	codes.resize(1);
+
+	// Clusters from this index and up need their mean and error updated
+	int dirty = 0;
+
+	while (true) {
+		for (int k=dirty; k<codes.size(); k++) {
+			Vec<N> mean;
+			mean.zero();
+			int weight = 0;
+			for (int i=0; i<members[k].size(); i++) {
+				mean.addMultiplied(uniqueVecs[members[k][i]], uniqueCounts[members[k][i]]);
+				weight += uniqueCounts[members[k][i]];
+			}
+			mean /= (float)weight;
+			codes[k].codeVec = mean;
+
+			errors[k] = 0;
+			for (int i=0; i<members[k].size(); i++)
+				errors[k] += Vec<N>::distanceSquared(uniqueVecs[members[k][i]], mean) * uniqueCounts[members[k][i]];
+		}
+		dirty = codes.size();
+
+		if (codes.size() >= numCodes)
+			break;
+
+		// There are never more clusters than codes, so a linear search is fine.
+		int worst = -1;
+		for (int k=0; k<codes.size(); k++)
+			if (members[k].size() > 1 && errors[k] > 0 && (worst == -1 || errors[k] > errors[worst]))
+				worst = k;
+		if (worst == -1)
+			break;
+
+		// Find the principal axis of the cluster with a few rounds of power
+		// iteration, starting from the direction of its furthest vector.
+		const QVector<int>& cluster = members[worst];
+		const Vec<N>& mean = codes[worst].codeVec;
+		Vec<N> axis;
+		float furthest = -1;
+		for (int i=0; i<cluster.size(); i++) {
+			const float distance = Vec<N>::distanceSquared(uniqueVecs[cluster[i]], mean);
+			if (distance > furthest) {
+				furthest = distance;
+				axis = uniqueVecs[cluster[i]] - mean;
+			}
+		}
+		for (int iteration=0; iteration<8; iteration++) {
+			Vec<N> next;
+			next.zero();
+			for (int i=0; i<cluster.size(); i++) {
+				const Vec<N> diff = uniqueVecs[cluster[i]] - mean;
+				float dot = 0;
+				for (uint j=0; j<N; j++)
+					dot += diff[j] * axis[j];
+				next.addMultiplied(diff, dot * uniqueCounts[cluster[i]]);
+			}
+			if (next.lengthSquared() <= 0)
+				break;
+			next.normalize();
+			axis = next;
+		}
+
+		// Cut through the mean
+		QVector<int> left, right;
+		for (int i=0; i<cluster.size(); i++) {
+			const Vec<N> diff = uniqueVecs[cluster[i]] - mean;
+			float dot = 0;
+			for (uint j=0; j<N; j++)
+				dot += diff[j] * axis[j];
+			if (dot < 0)
+				left.push_back(cluster[i]);
+			else
+				right.push_back(cluster[i]);
+		}
+		if (left.isEmpty() || right.isEmpty()) {
+			errors[worst] = 0;
+			continue;
+		}
+
+		// Move the last cluster into the old slot, so the two new halves
+		// end up last.
+		members[worst] = members.last();
+		errors[worst] = errors.last();
+		codes[worst].codeVec = codes.last().codeVec;
+		members.last() = left;
+		members.push_back(right);
+		errors.push_back(0);
+		codes.push_back(Code());
+		dirty = codes.size() - 2;
+	}
+
+	refine(2);
+}
+
+template<uint N>
+void VectorQuantizer<N>::compress(const VecStore<N>& vectors, int numCodes) {
+	QElapsedTimer timer;
+	timer.start();
+
+	// The input vectors don't have to be in a specific order, so to save a lot
+	// of time later, we remove all duplicates and count how many times each
+	// one occurs. This isn't as slow as it sounds since the vectors have very
+	// efficient hashing.
+	//
+	// Identical vectors have identical hashes, so the hash value splits the
+	// input into shards that can be deduplicated on separate threads without
+	// any merging. Each shard maps its vectors to where they first occur in
+	// the input, and counts them there.
+	const int shardCount = (vectors.size() < VQ_RLE_PARALLEL_MIN) ? 1 : QThread::idealThreadCount();
+	const int inputSize = vectors.size();
+	QVector<int> firstCounts(inputSize, 0);
+	QVector<int> shards(shardCount);
+	for (int i=0; i<shardCount; i++)
+		shards[i] = i;
+
+	// Sort the indices by shard first, still in input order within each
+	// shard, so every shard only walks its own vectors.
+	QVector<int> shardStart(shardCount + 1, 0);
+	for (int i=0; i<inputSize; i++)
+		shardStart[vectors.hash(i) % shardCount + 1]++;
+	for (int i=0; i<shardCount; i++)
+		shardStart[i + 1] += shardStart[i];
+	QVector<int> shardIndices(inputSize);
+	QVector<int> next = shardStart;
+	for (int i=0; i<inputSize; i++)
+		shardIndices[next[vectors.hash(i) % shardCount]++] = i;
+
+	const VecStore<N>* input = &vectors;
+	int* counts = firstCounts.data();
+	const int* indices = shardIndices.constData();
+	const int* starts = shardStart.constData();
+	QtConcurrent::blockingMap(shards, [input, counts, indices, starts](int shard) {
+		QHash<VecKey<N>, int> rle;
+		for (int k=starts[shard]; k<starts[shard + 1]; k++) {
+			const int i = indices[k];
+			const uint hash = input->hash(i);
+
+			// Single lookup. A new vector gets a zero, so store first index + 1.
+			const VecKey<N> key = { input->row(i), hash };
+			int& first = rle[key];
+			if (first == 0)
+				first = i + 1;
+			counts[first - 1]++;
+		}
+	});
+
+	// Collect the unique vectors in order of first occurrence, so the result
+	// doesn't depend on the number of shards or the hash table layout.
+	int uniqueCount = 0;
+	for (int i=0; i<inputSize; i++)
+		uniqueCount += (firstCounts[i] > 0) ? 1 : 0;
+
+	uniqueVecs.clear();
+	uniqueCounts.clear();
+	uniqueVecs.reserve(uniqueCount);
+	uniqueCounts.reserve(uniqueCount);
+	for (int i=0; i<inputSize; i++) {
+		if (firstCounts[i] > 0) {
+			uniqueVecs.push_back(vectors[i], vectors.hash(i));
+			uniqueCounts.push_back(firstCounts[i]);
+		}
+	}
+	firstCounts.clear();
 
-	// Fill in the rest of the codes by splitting the one with the highest error
+	qDebug() << "RLE completed in" << timer.elapsed() << "ms," << shardCount << "shards";
+	qDebug() << "RLE result:" << vectors.size() << "=>" << uniqueVecs.size();
+
+	if (settings.starts > 1)
+		trainMultiStart(numCodes);
+	else
+		train(numCodes);
+
+	uniqueVecs.clear();
+	uniqueCounts.clear();
+
+	qDebug() << "Compression completed in" << timer.elapsed() << "ms";
+}
+
+template<uint N>
+void VectorQuantizer<N>::train(int numCodes) {
+	int repairs = 0;
+
+	QElapsedTimer timer;
+	timer.start();
+
+	assignments.fill(0, uniqueVecs.size());
+	activeCount = uniqueVecs.size();
+	if (settings.miniBatch) {
+		shuffle();
+		activeCount = 0;
+	}
+
+	codes.clear();
+	codes.reserve(numCodes);
+	placeCount = 0;
+	recallSamples = 0;
+	recallHits = 0;
+
+	switch (settings.init) {
+	case VQ_INIT_KMEANSPP:	initKMeansPlusPlus(numCodes);	break;
+	case VQ_INIT_PCA:		initPrincipalSplit(numCodes);	break;
+	default:				initSplit(numCodes);			break;
+	}
+
+	// A mini-batch codebook has only seen part of the input, so place
+	// everything in it before repairing.
+	if (activeCount < uniqueVecs.size()) {
+		activeCount = uniqueVecs.size();
+		refine(1);
+	}
+
+	qDebug() << "Initial codebook done in" << timer.elapsed() << "ms. Codes:" << codeCount();
+
+	// Fill in the rest of the codes by splitting the ones with the highest error
 	// until we have all the codes we want, or can't split anymore.
+	buildSplitCandidates();
+
 	while (codes.size() < numCodes) {
 		const int codesBefore = codes.size();
 		const int n = numCodes - codesBefore;
+		QVector<int> parents;
+		QVector<int> children;
 
 		for (int i=0; i<n; i++) {
-			const int splitCandidate = findBestSplitCandidate();
+			const int splitCandidate = popSplitCandidate();
 			if (splitCandidate == -1)
 				break;
 
-			splitCode(splitCandidate);
-
-			// Reset this so it won't be found in the next iteration
-			codes[splitCandidate].maxDistance = 0;
+			parents.push_back(splitCandidate);
+			children.push_back(splitCode(splitCandidate));
 		}
 
 		if (codes.size() == codesBefore) {
@@ -426,9 +1319,9 @@ void VectorQuantizer<N>::compress(const QVector<Vec<N>>& vectors, int numCodes)
 			break;
 		}
 
-		place(rle);
-		place(rle);
-		place(rle);
+		placeLocal(parents, children);
+
+		const int codesBeforeRemoval = codes.size();
 		removeUnusedCodes();
 
 		if (codes.size() == codesBefore) {
@@ -436,11 +1329,93 @@ void VectorQuantizer<N>::compress(const QVector<Vec<N>>& vectors, int numCodes)
 			break;
 		}
 
+		if (codes.size() == codesBeforeRemoval) {
+			for (int i=0; i<parents.size(); i++) {
+				pushSplitCandidate(parents[i]);
+				pushSplitCandidate(children[i]);
+			}
+		} else {
+			// The code indices have changed, so start over.
+			buildSplitCandidates();
+		}
+
 		repairs++;
 		qDebug() << "Repair" << repairs << "done. Codes:" << codeCount();
 	}
 
-	qDebug() << "Compression completed in" << timer.elapsed() << "ms";
+	// The repairs only moved vectors between the halves of each split, so do a
+	// final pass over everything to let vectors settle in their closest code.
+	if (repairs > 0) {
+		place();
+		removeUnusedCodes();
+	}
+
+	// The codebook is final, so index it for the encoder
+	buildSearchIndex();
+	measureDistortion();
+	splitCandidates.clear();
+	assignments.clear();
+
+	qDebug() << "Training completed in" << timer.elapsed() << "ms," << placeCount << "full passes. Distortion:" << totalDistortion;
+	if (recallSamples > 0)
+		qDebug() << "Approximate search recall:" << (100.0f * recallHits / recallSamples) << "%";
+}
+
+template<uint N>
+void VectorQuantizer<N>::trainMultiStart(int numCodes) {
+	// Run the training once per start, each with its own seed, on as many
+	// threads as there are, and keep the codebook with the lowest distortion.
+	// The seeds are seed, seed+1, ... and ties go to the first start, so the
+	// result doesn't depend on the thread timing, and is never worse than a
+	// single run with the same seed. Every run gets the unique vectors in
+	// the same order of first occurrence, and is scored over all of them
+	// with the codes the encoder will pick, so the starts compare fairly.
+	if (settings.init != VQ_INIT_KMEANSPP && !settings.miniBatch) {
+		qDebug() << "Multiple starts need a randomized codebook (kmeans++ or mini-batch), training once";
+		train(numCodes);
+		return;
+	}
+
+	QVector<VectorQuantizer<N>> runs;
+	for (int i=0; i<settings.starts; i++) {
+		VQSettings runSettings = settings;
+		runSettings.seed = settings.seed + i;
+		runSettings.starts = 1;
+		runs.push_back(VectorQuantizer<N>(runSettings));
+		runs.last().uniqueVecs = uniqueVecs;
+		runs.last().uniqueCounts = uniqueCounts;
+	}
+
+	QtConcurrent::blockingMap(runs, [numCodes](VectorQuantizer<N>& run) {
+		run.train(numCodes);
+		run.uniqueVecs.clear();
+		run.uniqueCounts.clear();
+	});
+
+	int best = 0;
+	for (int i=1; i<runs.size(); i++)
+		if (runs[i].totalDistortion < runs[best].totalDistortion)
+			best = i;
+
+	qDebug() << "Start" << (best + 1) << "of" << runs.size() << "has the lowest distortion:" << runs[best].totalDistortion;
+
+	codes = runs[best].codes;
+	placeCount = runs[best].placeCount;
+	totalDistortion = runs[best].totalDistortion;
+	buildSearchIndex();
+}
+
+template<uint N>
+void VectorQuantizer<N>::measureDistortion() {
+	// Sum of squared errors over the whole input, with every vector in the
+	// code the encoder will pick for it. That isn't always the code it was
+	// last placed in, the repairs only move vectors between the halves of a
+	// split, and the approximate search can miss the closest code.
+	QVector<int> closest(uniqueVecs.size());
+	findClosestBatch(uniqueVecs, uniqueVecs.size(), closest.data());
+	totalDistortion = 0;
+	for (int i=0; i<uniqueVecs.size(); i++)
+		totalDistortion += Vec<N>::distanceSquared(codes[closest[i]].codeVec, uniqueVecs[i]) * uniqueCounts[i];
 }
 
 template<uint N>